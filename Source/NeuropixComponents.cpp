@@ -23,6 +23,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "NeuropixComponents.h"
 
+#if JUCE_LINUX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #define MAXLEN 50
 
 np::NP_ErrorCode errorCode;
@@ -65,6 +70,20 @@ void BasestationConnectBoard::getInfo()
 	unsigned char version_minor;
 	uint16_t version_build;
 
+	errorCode = np::readBSCSN(basestation->slot, &serial_number);
+
+	// unchanged board: skip the remaining EEPROM reads
+	if (basestation->inventory != nullptr)
+	{
+		if (XmlElement* cached = basestation->inventory->findConnectBoard(basestation->slot, serial_number))
+		{
+			boot_version = cached->getStringAttribute("boot_version");
+			version = cached->getStringAttribute("version");
+			part_number = cached->getStringAttribute("part_number");
+			return;
+		}
+	}
+
 	errorCode = np::getBSCBootVersion(basestation->slot, &version_major, &version_minor, &version_build);
 
 	boot_version = String(version_major) + "." + String(version_minor);
@@ -77,18 +96,27 @@ void BasestationConnectBoard::getInfo()
 
 	version = String(version_major) + "." + String(version_minor);
 
-	errorCode = np::readBSCSN(basestation->slot, &serial_number);
-
 	char pn[MAXLEN];
-	np::readBSCPN(basestation->slot, pn, MAXLEN);
+	errorCode = np::readBSCPN(basestation->slot, pn, MAXLEN);
 
 	part_number = String(pn);
 
+	if (basestation->inventory != nullptr)
+		basestation->inventory->storeConnectBoard(this);
+
 }
 
 void Headstage::getInfo()
 {
 
+	if (XmlElement* cached = probe->cachedInventory)
+	{
+		version = cached->getStringAttribute("hs_version");
+		serial_number = uint64_t(cached->getStringAttribute("hs_serial").getLargeIntValue());
+		part_number = cached->getStringAttribute("hs_part_number");
+		return;
+	}
+
 	unsigned char version_major;
 	unsigned char version_minor;
 
@@ -109,6 +137,13 @@ void Headstage::getInfo()
 void Flex::getInfo()
 {
 
+	if (XmlElement* cached = probe->cachedInventory)
+	{
+		version = cached->getStringAttribute("flex_version");
+		part_number = cached->getStringAttribute("flex_part_number");
+		return;
+	}
+
 	unsigned char version_major;
 	unsigned char version_minor;
 
@@ -129,22 +164,59 @@ void Probe::getInfo()
 
 	errorCode = np::readId(basestation->slot, port, &serial_number);
 
+	// the serial number identifies the probe; headstage and flex details come with it
+	if (basestation->inventory != nullptr)
+		cachedInventory = basestation->inventory->findProbe(basestation->slot, port, serial_number);
+
+	if (cachedInventory != nullptr)
+	{
+		part_number = cachedInventory->getStringAttribute("part_number");
+		return;
+	}
+
 	char pn[MAXLEN];
 	errorCode = np::readProbePN(basestation->slot, port, pn, MAXLEN);
 
 	part_number = String(pn);
 }
 
-Probe::Probe(Basestation* bs, signed char port_) : Thread("probe_" + String(port_)), basestation(bs), port(port_), fifoFillPercentage(0.0f)
+Probe::Probe(Basestation* bs, signed char port_) : Thread("probe_" + String(port_)), basestation(bs), port(port_),
+	threadIndex(0), processingTimeMs(0.0),
+	apScale(384), lfpScale(384), apBlock(384, MAX_SAMPLECOUNT * 12), lfpBlock(384, MAX_SAMPLECOUNT), rawDataMode(false),
+	useHardwareClock(false), spikeDetectionEnabled(false), spikeDetector(384), detectedSpikes(12 * 384), spikeBatch(12 * 384),
+	spikeQueue(16384), activityMonitoringEnabled(false), softwareFilterEnabled(false), apFilter(384), commonReferenceMode(CAR_NONE), activeChannels(384), numActiveChannels(0), carMask(384), carScratch(384),
+	compactOutput(false), apScaleCompact(384), lfpScaleCompact(384), apPacketScratch(12 * 384), lfpPacketScratch(384),
+	channelMajorEnabled(false), channelMajorStride(getChannelMajorStride(MAX_SAMPLECOUNT * 12)),
+	packet(MAX_SAMPLECOUNT), pipelined(false)
 {
 
+	apBuffer = nullptr;
+	lfpBuffer = nullptr;
+
+	// the hardware state is unknown until each setting has been written once
+	invalidateConfiguration();
+	configurationDirty = false;
+	appliedRefId = np::EXT_REF;
+	appliedRefElectrodeBank = 0;
+	appliedFilterState = false;
+
 	setStatus(ProbeStatus::DISCONNECTED);
 	setSelected(false);
 
+	cachedInventory = nullptr;
+
+	softwareGainCorrection = false;
+	gainCorrectionLoaded = false;
+	apGainCorrection.malloc(960 * 8);
+	lfpGainCorrection.malloc(960 * 8);
+
+	getInfo();
+
 	flex = new Flex(this);
 	headstage = new Headstage(this);
 
-	getInfo();
+	if (cachedInventory == nullptr && basestation->inventory != nullptr)
+		basestation->inventory->storeProbe(this);
 
 	for (int i = 0; i < 384; i++)
 	{
@@ -162,6 +234,126 @@ Probe::Probe(Basestation* bs, signed char port_) : Thread("probe_" + String(port
 	gains.add(2000.0f);
 	gains.add(3000.0f);
 
+	updateActiveChannels();
+	updateScaleTables();
+
+	// 4th-order Butterworth highpass at 300 Hz, 2nd-order Butterworth lowpass at 6 kHz
+	apFilter.addSection(BiquadCoefficients::highpass(30000.0, 300.0, 0.5412));
+	apFilter.addSection(BiquadCoefficients::highpass(30000.0, 300.0, 1.3066));
+	apFilter.addSection(BiquadCoefficients::lowpass(30000.0, 6000.0, 0.7071));
+
+}
+
+void Probe::updateScaleTables()
+{
+	// ADC range is 1.2 V over 10 bits, divided by the amplifier gain
+	const float microvoltsPerBit = 1.2f / 1024.0f * 1000000.0f;
+
+	bool corrected = isGainCorrectedInSoftware();
+
+	for (int channel = 0; channel < 384; channel++)
+	{
+		apScale[channel] = microvoltsPerBit / gains[apGains[channel]];
+		lfpScale[channel] = microvoltsPerBit / gains[lfpGains[channel]];
+
+		// fold the electrode's calibration factor into the scale, so conversion cost is unchanged
+		if (corrected && channelMap[channel] != BANK_SELECT::DISCONNECTED)
+		{
+			int electrode = channel + int(channelMap[channel]) * 384;
+
+			apScale[channel] *= apGainCorrection[electrode * 8 + apGains[channel]];
+			lfpScale[channel] *= lfpGainCorrection[electrode * 8 + lfpGains[channel]];
+		}
+	}
+
+	for (int i = 0; i < numActiveChannels; i++)
+	{
+		apScaleCompact[i] = apScale[activeChannels[i]];
+		lfpScaleCompact[i] = lfpScale[activeChannels[i]];
+	}
+}
+
+void Probe::setSpikeDetection(bool enabled, float thresholdScale)
+{
+	spikeDetectionEnabled = enabled;
+	spikeDetector.setThresholdScale(thresholdScale);
+}
+
+void Probe::setActivityMonitoring(bool enabled)
+{
+	// the accumulators belong to the thread processing the packets, which clears them before its next block
+	if (enabled && !activityMonitoringEnabled)
+		activityResetPending = 1;
+
+	activityMonitoringEnabled = enabled;
+}
+
+void Probe::setSoftwareFilter(bool enabled)
+{
+	softwareFilterEnabled = enabled;
+}
+
+void Probe::setCommonReference(CommonReferenceMode mode)
+{
+	commonReferenceMode = mode;
+}
+
+void Probe::updateActiveChannels()
+{
+	numActiveChannels = 0;
+
+	for (int channel = 0; channel < 384; channel++)
+	{
+		// channel 191 is the internal reference site
+		bool included = channel != 191 && channelMap[channel] != BANK_SELECT::DISCONNECTED;
+
+		carMask[channel] = included ? 1.0f : 0.0f;
+
+		if (included)
+			activeChannels[numActiveChannels++] = channel;
+	}
+
+	spikeDetector.setChannelMask(carMask.getData());
+}
+
+void Probe::setCompactOutput(bool compact)
+{
+	compactOutput = compact;
+
+	updateOutputLayout();
+}
+
+int Probe::getNumOutputChannels() const
+{
+	// with nothing connected yet, keep the full layout rather than an empty stream
+	if (compactOutput && !rawDataMode && numActiveChannels > 0)
+		return numActiveChannels;
+
+	return 384;
+}
+
+int Probe::getOutputChannel(int outputIndex) const
+{
+	return getNumOutputChannels() == 384 ? outputIndex : activeChannels[outputIndex];
+}
+
+void Probe::updateOutputLayout()
+{
+	int numOutputChannels = getNumOutputChannels();
+
+	apBlock.numChannels = numOutputChannels;
+	lfpBlock.numChannels = numOutputChannels;
+
+	if (apBuffer != nullptr)
+	{
+		apBuffer->resize(numOutputChannels, 10000);
+		lfpBuffer->resize(numOutputChannels, 10000);
+	}
+}
+
+bool Probe::needsFullLayout() const
+{
+	return commonReferenceMode != CAR_NONE || softwareFilterEnabled || spikeDetectionEnabled || activityMonitoringEnabled;
 }
 
 void Probe::setStatus(ProbeStatus status)
@@ -169,222 +361,1698 @@ void Probe::setStatus(ProbeStatus status)
 	this->status = status;
 }
 
-void Probe::setSelected(bool isSelected_)
-{
-	isSelected = isSelected_;
+void Probe::setSelected(bool isSelected_)
+{
+	isSelected = isSelected_;
+}
+
+CalibrationWarning::CalibrationWarning(String message_) : message(message_)
+{
+}
+
+void CalibrationWarning::messageCallback()
+{
+	AlertWindow::showMessageBoxAsync(AlertWindow::AlertIconType::WarningIcon, "Calibration files missing", message, "OK");
+}
+
+np::NP_ErrorCode Probe::calibrate()
+{
+	File baseDirectory = File::getSpecialLocation(File::currentExecutableFile).getParentDirectory();
+	File calibrationDirectory = baseDirectory.getChildFile("CalibrationInfo");
+	File probeDirectory = calibrationDirectory.getChildFile(String(serial_number));
+
+	std::cout << probeDirectory.getFullPathName() << std::endl;
+
+	if (probeDirectory.exists())
+	{
+		File adcCsv = probeDirectory.getChildFile(String(serial_number) + "_ADCCalibration.csv");
+		File adcCache = probeDirectory.getChildFile(String(serial_number) + "_ADCCalibration.bin");
+		String adcFile = adcCsv.getFullPathName();
+		String gainFile = probeDirectory.getChildFile(String(serial_number) + "_gainCalValues.csv").getFullPathName();
+		std::cout << adcFile << std::endl;
+
+		if (loadAdcCalibrationCache(adcCsv, adcCache))
+		{
+			std::cout << "Successful ADC calibration (cached)." << std::endl;
+		}
+		else
+		{
+			np::NP_ErrorCode ec = np::setADCCalibration(basestation->slot, port, adcFile.toRawUTF8());
+
+			// only a successful CSV load may be cached
+			if (ec == np::SUCCESS)
+			{
+				std::cout << "Successful ADC calibration." << std::endl;
+				saveAdcCalibrationCache(adcCsv, adcCache);
+			}
+			else
+				std::cout << "Unsuccessful ADC calibration, failed with error code: " << ec << std::endl;
+		}
+
+		std::cout << gainFile << std::endl;
+
+		gainCalibrationFile = File(gainFile);
+		gainCorrectionLoaded = loadGainCorrection(gainCalibrationFile);
+
+		uploadGainCalibration();
+		updateScaleTables();
+
+		return np::writeProbeConfiguration(basestation->slot, port, false);
+	}
+	else {
+		// show popup notification window
+		String message = "Missing calibration files for probe serial number " + String(serial_number) + ". ADC and Gain calibration files must be located in 'CalibrationInfo\\<serial_number>' folder in the directory where the Open Ephys GUI was launched. The GUI will proceed without calibration.";
+
+		// probes are calibrated on initialization threads, so the warning is shown from the message thread
+		(new CalibrationWarning(message))->post();
+	}
+
+	return np::SUCCESS;
+}
+
+bool Probe::loadGainCorrection(const File& csvFile)
+{
+	if (!csvFile.existsAsFile())
+		return false;
+
+	StringArray lines;
+	csvFile.readLines(lines);
+
+	if (lines.size() < 2)
+		return false;
+
+	gainCalibrationHeader = lines[0];
+
+	for (int i = 0; i < 960 * 8; i++)
+	{
+		apGainCorrection[i] = 1.0f;
+		lfpGainCorrection[i] = 1.0f;
+	}
+
+	int numElectrodes = 0;
+
+	// electrode number (1 - 960), then AP factors for gain indices 0 - 7, then LFP factors
+	for (int line = 1; line < lines.size(); line++)
+	{
+		StringArray values;
+		values.addTokens(lines[line], ",", "");
+
+		if (values.size() < 17)
+			continue;
+
+		int electrode = values[0].getIntValue() - 1;
+
+		if (electrode < 0 || electrode >= 960)
+			continue;
+
+		for (int gain = 0; gain < 8; gain++)
+		{
+			apGainCorrection[electrode * 8 + gain] = values[1 + gain].getFloatValue();
+			lfpGainCorrection[electrode * 8 + gain] = values[9 + gain].getFloatValue();
+		}
+
+		numElectrodes++;
+	}
+
+	std::cout << "Read gain correction factors for " << numElectrodes << " electrodes" << std::endl;
+
+	return numElectrodes > 0;
+}
+
+void Probe::uploadGainCalibration()
+{
+	if (!gainCalibrationFile.existsAsFile())
+		return;
+
+	File source = gainCalibrationFile;
+	bool unity = isGainCorrectedInSoftware();
+
+	// the correction is applied in the scale tables, so the FPGA gets unity factors
+	if (unity)
+	{
+		source = File::getSpecialLocation(File::tempDirectory).getChildFile(String(serial_number) + "_unityGainCalValues.csv");
+
+		String factors = gainCalibrationHeader + "\n";
+
+		for (int electrode = 1; electrode <= 960; electrode++)
+		{
+			factors += String(electrode);
+
+			for (int i = 0; i < 16; i++)
+				factors += ",1";
+
+			factors += "\n";
+		}
+
+		source.replaceWithText(factors);
+	}
+
+	np::NP_ErrorCode ec = np::setGainCalibration(basestation->slot, port, source.getFullPathName().toRawUTF8());
+
+	if (ec == np::SUCCESS)
+		std::cout << "Successful gain calibration" << (unity ? " (unity, corrected in software)." : ".") << std::endl;
+	else
+		std::cout << "Unsuccessful gain calibration, failed with error code: " << ec << std::endl;
+}
+
+void Probe::setSoftwareGainCorrection(bool enabled)
+{
+	if (softwareGainCorrection == enabled)
+		return;
+
+	softwareGainCorrection = enabled;
+
+	// swap where the correction is applied if the probe has already been calibrated
+	if (gainCorrectionLoaded && !rawDataMode)
+		uploadGainCalibration();
+
+	updateScaleTables();
+}
+
+bool Probe::isGainCorrectedInSoftware() const
+{
+	// raw samples publish one bitVolts value per band, which cannot carry per-electrode factors
+	return softwareGainCorrection && gainCorrectionLoaded && !rawDataMode;
+}
+
+static uint32 getCalibrationChecksum(const np::ADC_Calib* records, int count)
+{
+	// FNV-1a over the record bytes
+	const uint8* bytes = reinterpret_cast<const uint8*>(records);
+	uint32 hash = 2166136261u;
+
+	for (size_t i = 0; i < count * sizeof(np::ADC_Calib); i++)
+		hash = (hash ^ bytes[i]) * 16777619u;
+
+	return hash;
+}
+
+bool Probe::loadAdcCalibrationCache(const File& csvFile, const File& cacheFile)
+{
+	if (!csvFile.existsAsFile() || !cacheFile.existsAsFile())
+		return false;
+
+	FileInputStream stream(cacheFile);
+
+	if (!stream.openedOk())
+		return false;
+
+	// the cache is only valid for this probe and the exact CSV it was built from
+	if (stream.readInt() != ADC_CACHE_MAGIC
+		|| stream.readInt() != ADC_CACHE_VERSION
+		|| uint64_t(stream.readInt64()) != serial_number
+		|| stream.readInt64() != csvFile.getSize()
+		|| stream.readInt64() != csvFile.getLastModificationTime().toMilliseconds()
+		|| stream.readInt() != NUM_ADCS)
+	{
+		std::cout << "ADC calibration cache is stale, reading " << csvFile.getFileName() << std::endl;
+		return false;
+	}
+
+	np::ADC_Calib records[NUM_ADCS];
+	int numBytes = NUM_ADCS * sizeof(np::ADC_Calib);
+
+	if (stream.read(records, numBytes) != numBytes
+		|| uint32(stream.readInt()) != getCalibrationChecksum(records, NUM_ADCS))
+	{
+		std::cout << "ADC calibration cache is corrupt, reading " << csvFile.getFileName() << std::endl;
+		return false;
+	}
+
+	for (int adc = 0; adc < NUM_ADCS; adc++)
+	{
+		np::NP_ErrorCode ec = np::setADCparams(basestation->slot, port, &records[adc]);
+
+		if (ec != np::SUCCESS)
+		{
+			std::cout << "Failed to load cached parameters for ADC " << adc << ", error code: " << ec << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void Probe::saveAdcCalibrationCache(const File& csvFile, const File& cacheFile)
+{
+	np::ADC_Calib records[NUM_ADCS];
+
+	// read back what the API parsed from the CSV
+	for (int adc = 0; adc < NUM_ADCS; adc++)
+	{
+		if (np::getADCparams(basestation->slot, port, adc, &records[adc]) != np::SUCCESS)
+			return;
+	}
+
+	cacheFile.deleteFile();
+
+	FileOutputStream stream(cacheFile);
+
+	if (!stream.openedOk())
+	{
+		std::cout << "Could not write ADC calibration cache " << cacheFile.getFullPathName() << std::endl;
+		return;
+	}
+
+	stream.writeInt(ADC_CACHE_MAGIC);
+	stream.writeInt(ADC_CACHE_VERSION);
+	stream.writeInt64(int64(serial_number));
+	stream.writeInt64(csvFile.getSize());
+	stream.writeInt64(csvFile.getLastModificationTime().toMilliseconds());
+	stream.writeInt(NUM_ADCS);
+	stream.write(records, NUM_ADCS * sizeof(np::ADC_Calib));
+	stream.writeInt(int(getCalibrationChecksum(records, NUM_ADCS)));
+}
+
+void Probe::setChannels(Array<int> channelStatus)
+{
+	stageChannels(channelStatus);
+
+	std::cout << "Updating electrode settings for"
+		<< " slot: " << static_cast<unsigned>(basestation->slot)
+		<< " port: " << static_cast<unsigned>(port) << std::endl;
+
+	np::NP_ErrorCode ec = writeConfiguration();
+	if (!ec == np::SUCCESS)
+		std::cout << "Failed to write channel config " << std::endl;
+	else
+		std::cout << "Successfully wrote channel config " << std::endl;
+
+}
+
+void Probe::stageChannels(const Array<int>& channelStatus)
+{
+
+	np::NP_ErrorCode ec;
+
+	int electrode;
+	BANK_SELECT electrode_bank;
+
+	int numChanged = 0;
+	bool failed = false;
+
+	for (int channel = 0; channel < channelMap.size(); channel++)
+	{
+
+		if (channel != 191)
+		{
+			if (channelStatus[channel])
+			{
+				electrode = channel;
+				electrode_bank = BANK_SELECT::BANK_0;
+			}
+			else if (channelStatus[channel + 384])
+			{
+				electrode = channel + 384;
+				electrode_bank = BANK_SELECT::BANK_1;
+			}
+			else if (channelStatus[channel + 2 * 384])
+			{
+				electrode = channel + 2 * 384;
+				electrode_bank = BANK_SELECT::BANK_2;
+			}
+			else
+			{
+				electrode_bank = BANK_SELECT::DISCONNECTED;
+			}
+
+			// only touch channels whose connection differs from what the probe already has
+			if (channelMapApplied && channelMap[channel] == electrode_bank)
+				continue;
+
+			channelMap.set(channel, electrode_bank);
+
+			ec = np::selectElectrode(basestation->slot, port, channel, electrode_bank);
+
+			if (ec != np::SUCCESS)
+				failed = true;
+
+			numChanged++;
+		}
+
+	}
+
+	// after a failed call the probe state is unknown, so the next change does a full pass
+	channelMapApplied = !failed;
+
+	if (numChanged > 0)
+	{
+		configurationDirty = true;
+
+		updateActiveChannels();
+		updateScaleTables();
+		updateOutputLayout();
+	}
+
+	std::cout << "Changed " << numChanged << " electrode connections" << std::endl;
+}
+
+void Probe::setApFilterState(bool disableHighPass)
+{
+	stageApFilterState(disableHighPass);
+
+	np::NP_ErrorCode ec = writeConfiguration();
+
+	std::cout << "Wrote filter " << int(disableHighPass) << " with error code " << ec << std::endl;
+}
+
+void Probe::stageApFilterState(bool disableHighPass)
+{
+	if (filterApplied && appliedFilterState == disableHighPass)
+		return;
+
+	filterApplied = true;
+
+	for (int channel = 0; channel < 384; channel++)
+	{
+		if (np::setAPCornerFrequency(basestation->slot, port, channel, disableHighPass) != np::SUCCESS)
+			filterApplied = false;
+	}
+
+	appliedFilterState = disableHighPass;
+	configurationDirty = true;
+}
+
+void Probe::setGains(unsigned char apGain, unsigned char lfpGain)
+{
+	stageGains(apGain, lfpGain);
+		
+	np::NP_ErrorCode ec = writeConfiguration();
+
+	std::cout << "Wrote gain " << int(apGain) << ", " << int(lfpGain) << " with error code " << ec << std::endl;
+}
+
+void Probe::stageGains(unsigned char apGain, unsigned char lfpGain)
+{
+	int numChanged = 0;
+	bool failed = false;
+
+	for (int channel = 0; channel < 384; channel++)
+	{
+		if (gainsApplied && apGains[channel] == int(apGain) && lfpGains[channel] == int(lfpGain))
+			continue;
+
+		if (np::setGain(basestation->slot, port, channel, apGain, lfpGain) != np::SUCCESS)
+			failed = true;
+
+		apGains.set(channel, int(apGain));
+		lfpGains.set(channel, int(lfpGain));
+		numChanged++;
+	}
+
+	gainsApplied = !failed;
+
+	if (numChanged > 0)
+	{
+		configurationDirty = true;
+		updateScaleTables();
+	}
+}
+
+
+void Probe::setReferences(np::channelreference_t refId, unsigned char refElectrodeBank)
+{
+	stageReferences(refId, refElectrodeBank);
+
+	np::NP_ErrorCode ec = writeConfiguration();
+
+	std::cout << "Wrote reference " << int(refId) << ", " << int(refElectrodeBank) << " with error code " << ec << std::endl;
+}
+
+void Probe::stageReferences(np::channelreference_t refId, unsigned char refElectrodeBank)
+{
+	if (referencesApplied && appliedRefId == refId && appliedRefElectrodeBank == refElectrodeBank)
+		return;
+
+	referencesApplied = true;
+
+	for (int channel = 0; channel < 384; channel++)
+	{
+		if (np::setReference(basestation->slot, port, channel, refId, refElectrodeBank) != np::SUCCESS)
+			referencesApplied = false;
+	}
+
+	appliedRefId = refId;
+	appliedRefElectrodeBank = refElectrodeBank;
+	configurationDirty = true;
+}
+
+void Probe::invalidateConfiguration()
+{
+	channelMapApplied = false;
+	gainsApplied = false;
+	referencesApplied = false;
+	filterApplied = false;
+}
+
+np::NP_ErrorCode Probe::applyConfiguration(const ProbeConfig& config)
+{
+	if (config.isEmpty())
+		return np::SUCCESS;
+
+	if (config.hasChannels)
+		stageChannels(config.channelStatus);
+
+	if (config.hasGains)
+		stageGains(config.apGain, config.lfpGain);
+
+	if (config.hasReferences)
+		stageReferences(config.refId, config.refElectrodeBank);
+
+	if (config.hasFilter)
+		stageApFilterState(config.disableHighPass);
+
+	np::NP_ErrorCode ec = writeConfiguration();
+
+	std::cout << "Wrote configuration for"
+		<< " slot: " << static_cast<unsigned>(basestation->slot)
+		<< " port: " << static_cast<unsigned>(port)
+		<< " with error code " << ec << std::endl;
+
+	return ec;
+}
+
+np::NP_ErrorCode Probe::writeConfiguration()
+{
+	// nothing staged since the last write
+	if (!configurationDirty)
+		return np::SUCCESS;
+
+	np::NP_ErrorCode ec = np::writeProbeConfiguration(basestation->slot, port, false);
+
+	if (ec == np::SUCCESS)
+		configurationDirty = false;
+	else
+		invalidateConfiguration();
+
+	return ec;
+}
+
+ProbeConfig::ProbeConfig() :
+	hasChannels(false),
+	hasGains(false), apGain(0), lfpGain(0),
+	hasReferences(false), refId(np::EXT_REF), refElectrodeBank(0),
+	hasFilter(false), disableHighPass(false)
+{
+}
+
+void ProbeConfig::setChannels(Array<int> channelStatus_)
+{
+	channelStatus = channelStatus_;
+	hasChannels = true;
+}
+
+void ProbeConfig::setGains(unsigned char apGain_, unsigned char lfpGain_)
+{
+	apGain = apGain_;
+	lfpGain = lfpGain_;
+	hasGains = true;
+}
+
+void ProbeConfig::setReferences(np::channelreference_t refId_, unsigned char refElectrodeBank_)
+{
+	refId = refId_;
+	refElectrodeBank = refElectrodeBank_;
+	hasReferences = true;
+}
+
+void ProbeConfig::setApFilterState(bool disableHighPass_)
+{
+	disableHighPass = disableHighPass_;
+	hasFilter = true;
+}
+
+bool ProbeConfig::isEmpty() const
+{
+	return !(hasChannels || hasGains || hasReferences || hasFilter);
+}
+
+void ProbeConfig::merge(const ProbeConfig& newer)
+{
+	if (newer.hasChannels)
+		setChannels(newer.channelStatus);
+
+	if (newer.hasGains)
+		setGains(newer.apGain, newer.lfpGain);
+
+	if (newer.hasReferences)
+		setReferences(newer.refId, newer.refElectrodeBank);
+
+	if (newer.hasFilter)
+		setApFilterState(newer.disableHighPass);
+}
+
+
+InventoryCache::InventoryCache() : hits(0), misses(0), changed(false)
+{
+	file = File::getSpecialLocation(File::userApplicationDataDirectory)
+		.getChildFile("Open Ephys").getChildFile("neuropix-pxi-inventory.xml");
+
+	if (file.existsAsFile())
+		xml = XmlDocument::parse(file);
+
+	if (xml == nullptr || !xml->hasTagName("NEUROPIX_INVENTORY"))
+		xml = new XmlElement("NEUROPIX_INVENTORY");
+}
+
+XmlElement* InventoryCache::getSlot(unsigned char slot)
+{
+	forEachXmlChildElementWithTagName(*xml, slotNode, "SLOT")
+	{
+		if (slotNode->getIntAttribute("index", -1) == int(slot))
+			return slotNode;
+	}
+
+	XmlElement* slotNode = xml->createNewChildElement("SLOT");
+	slotNode->setAttribute("index", int(slot));
+	return slotNode;
+}
+
+XmlElement* InventoryCache::findProbe(unsigned char slot, signed char port, uint64_t serialNumber)
+{
+	XmlElement* slotNode = getSlot(slot);
+
+	forEachXmlChildElementWithTagName(*slotNode, portNode, "PORT")
+	{
+		if (portNode->getIntAttribute("index", -1) == int(port)
+			&& uint64_t(portNode->getStringAttribute("serial").getLargeIntValue()) == serialNumber)
+		{
+			hits++;
+			return portNode;
+		}
+	}
+
+	misses++;
+	return nullptr;
+}
+
+XmlElement* InventoryCache::findConnectBoard(unsigned char slot, uint64_t serialNumber)
+{
+	XmlElement* board = getSlot(slot)->getChildByName("BSC");
+
+	if (board != nullptr && uint64_t(board->getStringAttribute("serial").getLargeIntValue()) == serialNumber)
+	{
+		hits++;
+		return board;
+	}
+
+	misses++;
+	return nullptr;
+}
+
+void InventoryCache::storeProbe(Probe* probe)
+{
+	XmlElement* slotNode = getSlot(probe->basestation->slot);
+	XmlElement* portNode = nullptr;
+
+	forEachXmlChildElementWithTagName(*slotNode, node, "PORT")
+	{
+		if (node->getIntAttribute("index", -1) == int(probe->port))
+			portNode = node;
+	}
+
+	if (portNode == nullptr)
+	{
+		portNode = slotNode->createNewChildElement("PORT");
+		portNode->setAttribute("index", int(probe->port));
+	}
+
+	portNode->setAttribute("serial", String(int64(probe->serial_number)));
+	portNode->setAttribute("part_number", probe->part_number);
+	portNode->setAttribute("hs_serial", String(int64(probe->headstage->serial_number)));
+	portNode->setAttribute("hs_part_number", probe->headstage->part_number);
+	portNode->setAttribute("hs_version", probe->headstage->version);
+	portNode->setAttribute("flex_part_number", probe->flex->part_number);
+	portNode->setAttribute("flex_version", probe->flex->version);
+
+	changed = true;
+}
+
+void InventoryCache::storeConnectBoard(BasestationConnectBoard* board)
+{
+	XmlElement* slotNode = getSlot(board->basestation->slot);
+	XmlElement* boardNode = slotNode->getChildByName("BSC");
+
+	if (boardNode == nullptr)
+		boardNode = slotNode->createNewChildElement("BSC");
+
+	boardNode->setAttribute("serial", String(int64(board->serial_number)));
+	boardNode->setAttribute("boot_version", board->boot_version);
+	boardNode->setAttribute("version", board->version);
+	boardNode->setAttribute("part_number", board->part_number);
+
+	changed = true;
+}
+
+void InventoryCache::save()
+{
+	if (!changed)
+		return;
+
+	file.getParentDirectory().createDirectory();
+
+	if (xml->writeToFile(file, String()))
+		changed = false;
+	else
+		std::cout << "Could not write hardware inventory to " << file.getFullPathName() << std::endl;
+}
+
+SampleBlock::SampleBlock(int numChannels_, int maxSamples_) :
+	data(numChannels_ * maxSamples_),
+	timestamps(maxSamples_),
+	eventCodes(maxSamples_),
+	numChannels(numChannels_),
+	maxSamples(maxSamples_),
+	numSamples(0)
+{
+}
+
+void SampleBlock::publish(DataBuffer* buffer)
+{
+	if (numSamples > 0)
+		buffer->addToBuffer(data.getData(), timestamps.getData(), eventCodes.getData(), numSamples, 1);
+
+	numSamples = 0;
+}
+
+RawSampleBuffer::RawSampleBuffer(int numChannels_, int size) :
+	fifo(size),
+	samples(numChannels_ * size),
+	timestamps(size),
+	eventCodes(size),
+	unitScale(numChannels_),
+	outputBlock(numChannels_, 1024),
+	numChannels(numChannels_)
+{
+	for (int i = 0; i < numChannels; i++)
+		unitScale[i] = 1.0f;
+}
+
+void RawSampleBuffer::clear()
+{
+	fifo.reset();
+}
+
+int RawSampleBuffer::write(const int16_t* data, const int64* ts, const uint64* ev, int numSamples)
+{
+	int start1, size1, start2, size2;
+	fifo.prepareToWrite(numSamples, start1, size1, start2, size2);
+
+	memcpy(samples + start1 * numChannels, data, size1 * numChannels * sizeof(int16_t));
+	memcpy(timestamps + start1, ts, size1 * sizeof(int64));
+	memcpy(eventCodes + start1, ev, size1 * sizeof(uint64));
+
+	if (size2 > 0)
+	{
+		memcpy(samples + start2 * numChannels, data + size1 * numChannels, size2 * numChannels * sizeof(int16_t));
+		memcpy(timestamps + start2, ts + size1, size2 * sizeof(int64));
+		memcpy(eventCodes + start2, ev + size1, size2 * sizeof(uint64));
+	}
+
+	fifo.finishedWrite(size1 + size2);
+
+	return size1 + size2;
+}
+
+int RawSampleBuffer::publishTo(DataBuffer* buffer)
+{
+	int total = 0;
+
+	while (fifo.getNumReady() > 0)
+	{
+		int start1, size1, start2, size2;
+		fifo.prepareToRead(outputBlock.maxSamples, start1, size1, start2, size2);
+
+		int blockStarts[2] = { start1, start2 };
+		int blockSizes[2] = { size1, size2 };
+
+		for (int b = 0; b < 2; b++)
+		{
+			if (blockSizes[b] == 0)
+				continue;
+
+			// samples stay in ADC units; the scale is carried by the channel bitVolts
+			convertSamples(samples + blockStarts[b] * numChannels, unitScale.getData(), outputBlock.getSample(outputBlock.numSamples), blockSizes[b], numChannels);
+			memcpy(outputBlock.timestamps + outputBlock.numSamples, timestamps + blockStarts[b], blockSizes[b] * sizeof(int64));
+			memcpy(outputBlock.eventCodes + outputBlock.numSamples, eventCodes + blockStarts[b], blockSizes[b] * sizeof(uint64));
+			outputBlock.numSamples += blockSizes[b];
+		}
+
+		fifo.finishedRead(size1 + size2);
+		total += size1 + size2;
+
+		outputBlock.publish(buffer);
+	}
+
+	return total;
+}
+
+void Probe::setRawDataMode(bool rawDataMode_)
+{
+	bool wasCorrected = isGainCorrectedInSoftware();
+
+	rawDataMode = rawDataMode_;
+
+	// software gain correction is suspended in raw mode, so the FPGA takes the real factors back
+	if (wasCorrected != isGainCorrectedInSoftware())
+	{
+		uploadGainCalibration();
+		updateScaleTables();
+	}
+
+	if (rawDataMode && apRawBuffer == nullptr)
+	{
+		apRawBuffer = new RawSampleBuffer(384, 10000);
+		lfpRawBuffer = new RawSampleBuffer(384, 10000);
+	}
+
+	updateOutputLayout();
+}
+
+void Probe::setChannelMajorEnabled(bool enabled)
+{
+	channelMajorEnabled = enabled;
+
+	if (channelMajorEnabled && apChannelMajor.size() == 0)
+		apChannelMajor.setSize(384 * channelMajorStride);
+}
+
+void Probe::addChannelDataListener(ChannelDataListener* listener)
+{
+	channelDataListeners.addIfNotAlreadyThere(listener);
+	setChannelMajorEnabled(true);
+}
+
+void Probe::removeChannelDataListener(ChannelDataListener* listener)
+{
+	channelDataListeners.removeFirstMatchingValue(listener);
+
+	// nothing else reads the transposed block, so the stage stops with the last listener
+	setChannelMajorEnabled(channelDataListeners.size() > 0);
+}
+
+void Probe::processChannelMajor()
+{
+	int numSamples = apBlock.numSamples;
+
+	if (numSamples == 0)
+		return;
+
+	int numChannels = apBlock.numChannels;
+
+	transposeSamples(apBlock.getSample(0), numChannels, apChannelMajor.getData(), channelMajorStride, numSamples, numChannels);
+
+	for (auto listener : channelDataListeners)
+		listener->channelDataReady(this, apChannelMajor.getData(), channelMajorStride, numChannels, numSamples, apBlock.timestamps);
+}
+
+void Probe::setPipelined(bool pipelined_)
+{
+	pipelined = pipelined_;
+
+	if (pipelined && packetRing == nullptr)
+	{
+		packetRing = new PacketRing(PACKET_RING_SIZE);
+		converter = new PacketConverter(this);
+	}
+}
+
+PacketRing::PacketRing(int size) :
+	fifo(size),
+	packets(size)
+{
+}
+
+void PacketRing::clear()
+{
+	fifo.reset();
+}
+
+np::electrodePacket* PacketRing::getWriteBlock(int maxPackets, int& numPackets)
+{
+	int start1, size1, start2, size2;
+	fifo.prepareToWrite(maxPackets, start1, size1, start2, size2);
+
+	numPackets = size1;
+
+	return packets + start1;
+}
+
+void PacketRing::finishedWrite(int numPackets)
+{
+	fifo.finishedWrite(numPackets);
+}
+
+const np::electrodePacket* PacketRing::getReadBlock(int maxPackets, int& numPackets)
+{
+	int start1, size1, start2, size2;
+	fifo.prepareToRead(jmin(fifo.getNumReady(), maxPackets), start1, size1, start2, size2);
+
+	numPackets = size1;
+
+	return packets + start1;
+}
+
+void PacketRing::finishedRead(int numPackets)
+{
+	fifo.finishedRead(numPackets);
+}
+
+PacketConverter::PacketConverter(Probe* probe_) :
+	Thread("converter_" + String(probe_->port)),
+	probe(probe_)
+{
+}
+
+void PacketConverter::run()
+{
+	while (!threadShouldExit())
+	{
+		int count;
+		// processPackets' sample blocks hold at most MAX_SAMPLECOUNT packets, so a backlog is drained in chunks
+		const np::electrodePacket* packets = probe->packetRing->getReadBlock(MAX_SAMPLECOUNT, count);
+
+		if (count > 0)
+		{
+			convertWait.dataReceived();
+			probe->processPackets(packets, count);
+			probe->packetRing->finishedRead(count);
+		}
+		else
+		{
+			convertWait.wait();
+		}
+	}
+}
+
+SpikeEventQueue::SpikeEventQueue(int size) :
+	fifo(size),
+	events(size)
+{
+	droppedEvents = 0;
+}
+
+void SpikeEventQueue::clear()
+{
+	fifo.reset();
+	droppedEvents = 0;
+}
+
+void SpikeEventQueue::write(const ProbeSpikeEvent* src, int numEvents)
+{
+	int start1, size1, start2, size2;
+	fifo.prepareToWrite(numEvents, start1, size1, start2, size2);
+
+	memcpy(events + start1, src, size1 * sizeof(ProbeSpikeEvent));
+
+	if (size2 > 0)
+		memcpy(events + start2, src + size1, size2 * sizeof(ProbeSpikeEvent));
+
+	fifo.finishedWrite(size1 + size2);
+
+	if (size1 + size2 < numEvents)
+		droppedEvents += numEvents - size1 - size2;
+}
+
+int SpikeEventQueue::read(ProbeSpikeEvent* dest, int maxEvents)
+{
+	int start1, size1, start2, size2;
+	fifo.prepareToRead(maxEvents, start1, size1, start2, size2);
+
+	memcpy(dest, events + start1, size1 * sizeof(ProbeSpikeEvent));
+
+	if (size2 > 0)
+		memcpy(dest + size1, events + start2, size2 * sizeof(ProbeSpikeEvent));
+
+	fifo.finishedRead(size1 + size2);
+
+	return size1 + size2;
+}
+
+ChannelActivityMonitor::ChannelActivityMonitor() :
+	samplesPerSnapshot(1500), // 50 ms at 30 kHz
+	apSums(384),
+	apSumSquares(384),
+	lfpSums(384),
+	lfpSumSquares(384)
+{
+	reset();
+}
+
+void ChannelActivityMonitor::reset()
+{
+	apSums.clear();
+	apSumSquares.clear();
+	lfpSums.clear();
+	lfpSumSquares.clear();
+
+	memset(spikeCounts, 0, sizeof(spikeCounts));
+
+	apSamples = 0;
+	lfpSamples = 0;
+
+	version = 0;
+}
+
+void ChannelActivityMonitor::addApSamples(const float* samples, int numSamples)
+{
+	accumulateMoments(samples, numSamples, 384, apSums.getData(), apSumSquares.getData());
+	apSamples += numSamples;
+}
+
+void ChannelActivityMonitor::addLfpSamples(const float* samples, int numSamples)
+{
+	accumulateMoments(samples, numSamples, 384, lfpSums.getData(), lfpSumSquares.getData());
+	lfpSamples += numSamples;
+}
+
+void ChannelActivityMonitor::endBlock(int64 sampleNumber)
+{
+	if (apSamples < samplesPerSnapshot)
+		return;
+
+	int v = version.get();
+
+	// write the half readers are not using, then publish it
+	ChannelActivitySnapshot& snapshot = snapshots[(v + 1) & 1];
+
+	const float apNorm = 1.0f / float(apSamples);
+	const float lfpNorm = lfpSamples > 0 ? 1.0f / float(lfpSamples) : 0.0f;
+	const float seconds = float(apSamples) / 30000.0f;
+
+	for (int ch = 0; ch < 384; ch++)
+	{
+		float apMean = apSums[ch] * apNorm;
+		snapshot.apRms[ch] = std::sqrt(jmax(0.0f, apSumSquares[ch] * apNorm - apMean * apMean));
+
+		float lfpMean = lfpSums[ch] * lfpNorm;
+		snapshot.lfpPower[ch] = jmax(0.0f, lfpSumSquares[ch] * lfpNorm - lfpMean * lfpMean);
+
+		snapshot.spikeRate[ch] = float(spikeCounts[ch]) / seconds;
+	}
+
+	snapshot.sampleNumber = sampleNumber;
+
+	version = v + 1;
+
+	apSums.clear();
+	apSumSquares.clear();
+	lfpSums.clear();
+	lfpSumSquares.clear();
+	memset(spikeCounts, 0, sizeof(spikeCounts));
+	apSamples = 0;
+	lfpSamples = 0;
+}
+
+bool ChannelActivityMonitor::getSnapshot(ChannelActivitySnapshot& dest) const
+{
+	for (int attempt = 0; attempt < 3; attempt++)
+	{
+		int v = version.get();
+
+		if (v == 0)
+			return false;
+
+		dest = snapshots[v & 1];
+
+		// the writer starts overwriting this half as soon as it publishes the next snapshot
+		if (version.get() == v)
+			return true;
+	}
+
+	return false;
+}
+
+PacketCounters::PacketCounters()
+{
+	reset();
+}
+
+void PacketCounters::reset()
+{
+	packets = 0;
+	readErrors = 0;
+	countErrors = 0;
+	serdesErrors = 0;
+	lockErrors = 0;
+	popErrors = 0;
+	syncErrors = 0;
+	timestampGaps = 0;
+	missedSamples = 0;
+	discontinuities = 0;
+	overflowSamples = 0;
+}
+
+void PacketCounters::addErrors(uint16_t status)
+{
+	if (status & ELECTRODEPACKET_STATUS_ERR_COUNT)
+		++countErrors;
+	if (status & ELECTRODEPACKET_STATUS_ERR_SERDES)
+		++serdesErrors;
+	if (status & ELECTRODEPACKET_STATUS_ERR_LOCK)
+		++lockErrors;
+	if (status & ELECTRODEPACKET_STATUS_ERR_POP)
+		++popErrors;
+	if (status & ELECTRODEPACKET_STATUS_ERR_SYNC)
+		++syncErrors;
+}
+
+void PacketCounters::addTimestampStep(int32_t step)
+{
+	if (step > 1 && step <= MAX_TIMESTAMP_STEP)
+	{
+		++timestampGaps;
+		missedSamples += step - 1;
+	}
+	else if (step != 1)
+	{
+		++discontinuities;
+	}
+}
+
+int64 PacketCounters::getTotalErrors() const
+{
+	return readErrors.get() + countErrors.get() + serdesErrors.get() + lockErrors.get()
+		+ popErrors.get() + syncErrors.get() + timestampGaps.get() + discontinuities.get() + overflowSamples.get();
+}
+
+String PacketCounters::toString() const
+{
+	String s;
+	s += "Packets: " + String(packets.get()) + "\n";
+	s += "Read errors: " + String(readErrors.get()) + "\n";
+	s += "Count errors: " + String(countErrors.get()) + "\n";
+	s += "Serdes errors: " + String(serdesErrors.get()) + "\n";
+	s += "Lock errors: " + String(lockErrors.get()) + "\n";
+	s += "Pop errors: " + String(popErrors.get()) + "\n";
+	s += "Sync errors: " + String(syncErrors.get()) + "\n";
+	s += "Timestamp gaps: " + String(timestampGaps.get()) + " (" + String(missedSamples.get()) + " samples)\n";
+	s += "Discontinuities: " + String(discontinuities.get()) + "\n";
+	s += "Raw buffer overflows: " + String(overflowSamples.get()) + " samples";
+	return s;
+}
+
+SampleClock::SampleClock()
+{
+	reset();
+}
+
+void SampleClock::reset()
+{
+	started = false;
+	lastTimestamp = 0;
+	sampleNumber = 0;
+}
+
+int64 SampleClock::getSampleNumber(uint32_t timestamp, int64 firstSampleNumber, PacketCounters& counters)
+{
+	if (!started)
+	{
+		started = true;
+		sampleNumber = firstSampleNumber;
+	}
+	else
+	{
+		// modular difference, so a 32-bit roll-over still yields a small positive step
+		int32_t step = int32_t(timestamp - lastTimestamp);
+
+		if (step != 1)
+			counters.addTimestampStep(step);
+
+		if (step >= 1 && step <= MAX_TIMESTAMP_STEP)
+			sampleNumber += step;
+		else
+			sampleNumber += 1; // resynchronises on the next timestamp
+	}
+
+	lastTimestamp = timestamp;
+
+	return sampleNumber;
+}
+
+AdaptiveWait::AdaptiveWait() :
+	spinCount(50),
+	yieldCount(50),
+	sleepPackets(4),
+	emptyReads(0)
+{
+	resetStatistics();
+}
+
+void AdaptiveWait::wait()
+{
+	emptyReads++;
+
+	if (sleepPackets <= 0 || emptyReads <= spinCount)
+	{
+		spins++;
+	}
+	else if (emptyReads <= spinCount + yieldCount)
+	{
+		yields++;
+		Thread::yield();
+	}
+	else
+	{
+		// 12 samples at 30 kHz per packet
+		int sleepMs = jmax(1, roundToInt(sleepPackets * 12 / 30.0f));
+
+		sleeps++;
+		sleepTimeMs += sleepMs;
+		Thread::sleep(sleepMs);
+	}
+}
+
+void AdaptiveWait::resetStatistics()
+{
+	emptyReads = 0;
+	spins = 0;
+	yields = 0;
+	sleeps = 0;
+	sleepTimeMs = 0;
+}
+
+String AdaptiveWait::getStatistics() const
+{
+	return "Empty reads: " + String(spins + yields + sleeps) + " (" + String(spins) + " spins, "
+		+ String(yields) + " yields, " + String(sleeps) + " sleeps totalling " + String(sleepTimeMs) + " ms)";
+}
+
+AdaptiveReadSize::AdaptiveReadSize()
+{
+	reset();
+}
+
+void AdaptiveReadSize::reset()
+{
+	size = SAMPLECOUNT;
+	maxSizeUsed = size;
+}
+
+void AdaptiveReadSize::update(size_t packetsRead, size_t packetsAvailable)
+{
+	if (packetsRead >= size_t(size))
+	{
+		// backlog: more than a full read is still waiting in the FIFO
+		if (packetsAvailable > size_t(size))
+			size = jmin(size * 2, MAX_SAMPLECOUNT);
+	}
+	else if (packetsRead < size_t(size / 4))
+	{
+		size = jmax(size / 2, MIN_SAMPLECOUNT);
+	}
+
+	if (size > maxSizeUsed)
+		maxSizeUsed = size;
+}
+
+FifoTelemetry::FifoTelemetry()
+{
+	reset();
+}
+
+void FifoTelemetry::reset()
+{
+	numIntervals = 0;
+	currentFill = 0.0f;
+	highWaterMark = 0.0f;
+
+	intervalMin = 1.0f;
+	intervalMax = 0.0f;
+	intervalSum = 0.0f;
+	intervalCount = 0;
+}
+
+void FifoTelemetry::addMeasurement(float fill)
+{
+	currentFill = fill;
+
+	if (fill > highWaterMark.get())
+		highWaterMark = fill;
+
+	intervalMin = jmin(intervalMin, fill);
+	intervalMax = jmax(intervalMax, fill);
+	intervalSum += fill;
+	intervalCount++;
+}
+
+void FifoTelemetry::endInterval()
+{
+	if (intervalCount == 0)
+		return;
+
+	int n = numIntervals.get();
+
+	FifoFillSample& sample = intervals[n % historySize];
+	sample.minimum = intervalMin;
+	sample.maximum = intervalMax;
+	sample.mean = intervalSum / float(intervalCount);
+
+	numIntervals = n + 1;
+
+	intervalMin = 1.0f;
+	intervalMax = 0.0f;
+	intervalSum = 0.0f;
+	intervalCount = 0;
+}
+
+FifoFillSample FifoTelemetry::getLatestInterval() const
+{
+	int n = numIntervals.get();
+
+	if (n == 0)
+	{
+		FifoFillSample empty = { 0.0f, 0.0f, 0.0f };
+		return empty;
+	}
+
+	return intervals[(n - 1) % historySize];
+}
+
+void FifoTelemetry::getHistory(Array<FifoFillSample>& history) const
+{
+	int n = numIntervals.get();
+
+	history.clearQuick();
+
+	for (int i = jmax(0, n - historySize); i < n; i++)
+		history.add(intervals[i % historySize]);
+}
+
+FifoTelemetryMonitor::FifoTelemetryMonitor(const Array<Probe*>& probes_) :
+	Thread("fifo_telemetry"),
+	probes(probes_),
+	pollIntervalMs(10),
+	measurementsPerInterval(100)
+{
+}
+
+void FifoTelemetryMonitor::run()
+{
+	int measurements = 0;
+
+	while (!threadShouldExit())
+	{
+		for (auto probe : probes)
+		{
+			size_t packetsAvailable = 0;
+			size_t headroom = 0;
+
+			if (np::getElectrodeDataFifoState(probe->basestation->slot, probe->port, &packetsAvailable, &headroom) == np::SUCCESS
+				&& packetsAvailable + headroom > 0)
+			{
+				probe->fifoTelemetry.addMeasurement(float(packetsAvailable) / float(packetsAvailable + headroom));
+			}
+		}
+
+		if (++measurements >= measurementsPerInterval)
+		{
+			for (auto probe : probes)
+				probe->fifoTelemetry.endInterval();
+
+			measurements = 0;
+		}
+
+		wait(pollIntervalMs);
+	}
+}
+
+ThreadSchedulingOptions::ThreadSchedulingOptions() :
+	priority(5),
+	realtime(false),
+	affinityMask(0),
+	spreadAcrossCores(false),
+	isolateMainThread(false)
+{
+}
+
+uint32 ThreadSchedulingOptions::getAffinityMask(int threadIndex) const
+{
+	if (!spreadAcrossCores || affinityMask == 0)
+		return affinityMask;
+
+	int numCores = 0;
+
+	for (int bit = 0; bit < 32; bit++)
+		if (affinityMask & (1u << bit))
+			numCores++;
+
+	int core = threadIndex % numCores;
+
+	for (int bit = 0; bit < 32; bit++)
+	{
+		if (affinityMask & (1u << bit))
+		{
+			if (core == 0)
+				return 1u << bit;
+			core--;
+		}
+	}
+
+	return affinityMask;
+}
+
+void ThreadSchedulingOptions::applyToCurrentThread(int threadIndex) const
+{
+	uint32 mask = getAffinityMask(threadIndex);
+
+	if (mask != 0)
+		Thread::setCurrentThreadAffinityMask(mask);
+
+	if (realtime)
+	{
+#if JUCE_LINUX
+		sched_param param;
+		param.sched_priority = jmap(priority, 0, 10, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+
+		int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+		if (result != 0)
+			std::cout << "Could not enable SCHED_FIFO for acquisition thread (error " << result << ")" << std::endl;
+#else
+		Thread::setCurrentThreadPriority(10);
+#endif
+	}
+	else
+	{
+		Thread::setCurrentThreadPriority(priority);
+	}
+}
+
+void ThreadSchedulingOptions::isolateCurrentThread() const
+{
+	if (isolateMainThread && affinityMask != 0 && ~affinityMask != 0)
+		Thread::setCurrentThreadAffinityMask(~affinityMask);
+}
+
+void Probe::setHardwareClock(bool useHardwareClock_)
+{
+	useHardwareClock = useHardwareClock_;
+}
+
+void Probe::run()
+{
+
+	//std::cout << "Thread running." << std::endl;
+
+	scheduling.applyToCurrentThread(threadIndex);
+
+	while (!threadShouldExit())
+	{
+		bool readFailed;
+
+		size_t count = readBatch(readFailed);
+
+		if (count > 0)
+		{
+			readWait.dataReceived();
+		}
+		else if (!readFailed)
+		{
+			readWait.wait();
+		}
+	}
+
 }
 
-void Probe::calibrate()
+size_t Probe::readBatch(bool& readFailed)
 {
-	File baseDirectory = File::getSpecialLocation(File::currentExecutableFile).getParentDirectory();
-	File calibrationDirectory = baseDirectory.getChildFile("CalibrationInfo");
-	File probeDirectory = calibrationDirectory.getChildFile(String(serial_number));
+	if (!pipelined)
+	{
+		size_t count = readPackets(packet, readSize.getSize(), readFailed);
 
-	std::cout << probeDirectory.getFullPathName() << std::endl;
+		if (count > 0)
+			processPackets(packet, count);
 
-	if (probeDirectory.exists())
+		return count;
+	}
+
+	int space;
+	np::electrodePacket* block = packetRing->getWriteBlock(readSize.getSize(), space);
+
+	if (space == 0)
 	{
-		String adcFile = probeDirectory.getChildFile(String(serial_number) + "_ADCCalibration.csv").getFullPathName();
-		String gainFile = probeDirectory.getChildFile(String(serial_number) + "_gainCalValues.csv").getFullPathName();
-		std::cout << adcFile << std::endl;
-		
-		errorCode = np::setADCCalibration(basestation->slot, port, adcFile.toRawUTF8());
+		// converter is behind; leave the packets in the hardware FIFO for now
+		++ringFullEvents;
+		readFailed = false;
+		return 0;
+	}
 
-		if (errorCode == 0)
-			std::cout << "Successful ADC calibration." << std::endl;
-		else
-			std::cout << "Unsuccessful ADC calibration, failed with error code: " << errorCode << std::endl;
+	size_t count = readPackets(block, space, readFailed);
 
-		std::cout << gainFile << std::endl;
-		
-		errorCode = np::setGainCalibration(basestation->slot, port, gainFile.toRawUTF8());
+	if (count > 0)
+		packetRing->finishedWrite(int(count));
 
-		if (errorCode == 0)
-			std::cout << "Successful gain calibration." << std::endl;
-		else
-			std::cout << "Unsuccessful gain calibration, failed with error code: " << errorCode << std::endl;
+	return count;
+}
+
+size_t Probe::readPackets(np::electrodePacket* dest, size_t maxPackets, bool& readFailed)
+{
+	size_t count = maxPackets;
+
+	np::NP_ErrorCode ec = readElectrodeData(
+		basestation->slot,
+		port,
+		dest,
+		&count,
+		maxPackets);
 
-		errorCode = np::writeProbeConfiguration(basestation->slot, port, false);
+	readFailed = (ec != np::SUCCESS);
+
+	if (readFailed)
+	{
+		++counters.readErrors;
+		std::cout << "Error code: " << ec << "for Basestation " << int(basestation->slot) << ", probe " << int(port) << std::endl;
+		return 0;
 	}
-	else {
-		// show popup notification window
-		String message = "Missing calibration files for probe serial number " + String(serial_number) + ". ADC and Gain calibration files must be located in 'CalibrationInfo\\<serial_number>' folder in the directory where the Open Ephys GUI was launched. The GUI will proceed without calibration.";
-		AlertWindow::showMessageBox(AlertWindow::AlertIconType::WarningIcon, "Calibration files missing", message, "OK");
+
+	// a read cut short by the end of the packet ring says nothing about the backlog
+	if (maxPackets == size_t(readSize.getSize()))
+	{
+		size_t packetsAvailable = 0;
+
+		if (readSize.needsFifoState(count))
+			np::getElectrodeDataFifoState(basestation->slot, port, &packetsAvailable, nullptr);
+
+		readSize.update(count, packetsAvailable);
 	}
+
+	return count;
 }
 
-void Probe::setChannels(Array<int> channelStatus)
+void Probe::processPackets(const np::electrodePacket* packets, size_t count)
 {
+	int64 startTicks = Time::getHighResolutionTicks();
 
-	np::NP_ErrorCode ec;
+	// apBlock, lfpBlock and the channel-major scratch are sized for MAX_SAMPLECOUNT packets
+	jassert(count <= MAX_SAMPLECOUNT);
 
-	for (int channel = 0; channel < channelMap.size(); channel++)
+	counters.packets += int64(count);
+
+	for (int packetNum = 0; packetNum < count; packetNum++)
 	{
-		if (channel != 191)
+		int firstSample = apBlock.numSamples;
+
+		for (int i = 0; i < 12; i++)
 		{
-			ec = np::selectElectrode(basestation->slot, port, channel, BANK_SELECT::DISCONNECTED);
-		}
-	}
+			eventCode = packets[packetNum].Status[i] >> 6; // AUX_IO<0:13>
 
-	int electrode;
-	BANK_SELECT electrode_bank;
+			counters.addStatus(packets[packetNum].Status[i]);
 
-	for (int channel = 0; channel < channelMap.size(); channel++)
-	{
+			uint32_t npx_timestamp = packets[packetNum].timestamp[i];
 
-		if (channel != 191)
-		{
-			if (channelStatus[channel])
-			{
-				electrode = channel;
-				electrode_bank = BANK_SELECT::BANK_0;
-			}
-			else if (channelStatus[channel + 384])
-			{
-				electrode = channel + 384;
-				electrode_bank = BANK_SELECT::BANK_1;
-			}
-			else if (channelStatus[channel + 2 * 384])
-			{
-				electrode = channel + 2 * 384;
-				electrode_bank = BANK_SELECT::BANK_2;
-			}
-			else
-			{
-				electrode_bank = BANK_SELECT::DISCONNECTED;
-			}
+			// the clock always runs, so timestamp gaps are counted in both modes
+			int64 hardwareSampleNumber = apClock.getSampleNumber(npx_timestamp, ap_timestamp + 1, counters);
 
-			channelMap.set(channel, electrode_bank);
+			if (useHardwareClock)
+				ap_timestamp = hardwareSampleNumber;
+			else
+				ap_timestamp += 1;
 
-			ec = np::selectElectrode(basestation->slot, port, channel, electrode_bank);
+			apBlock.timestamps[apBlock.numSamples] = ap_timestamp;
+			apBlock.eventCodes[apBlock.numSamples] = eventCode;
+			apBlock.numSamples++;
 
 		}
+		if (useHardwareClock)
+			lfp_timestamp = (apBlock.timestamps[firstSample] - 1) / 12 + 1; // one LFP sample per superframe
+		else
+			lfp_timestamp += 1;
 
-	}
+		lfpBlock.timestamps[lfpBlock.numSamples] = lfp_timestamp;
+		lfpBlock.eventCodes[lfpBlock.numSamples] = eventCode;
 
-	std::cout << "Updating electrode settings for"
-		<< " slot: " << static_cast<unsigned>(basestation->slot)
-		<< " port: " << static_cast<unsigned>(port) << std::endl;
+		if (rawDataMode)
+		{
+			// a full ring means NeuropixThread is not draining fast enough; the rest of the packet is lost
+			int written = apRawBuffer->write(&packets[packetNum].apData[0][0], apBlock.timestamps + firstSample, apBlock.eventCodes + firstSample, 12);
+			written += lfpRawBuffer->write(packets[packetNum].lfpData, lfpBlock.timestamps + lfpBlock.numSamples, lfpBlock.eventCodes + lfpBlock.numSamples, 1);
 
-	ec = np::writeProbeConfiguration(basestation->slot, port, false);
-	if (!ec == np::SUCCESS)
-		std::cout << "Failed to write channel config " << std::endl;
-	else
-		std::cout << "Successfully wrote channel config " << std::endl;
+			if (written < 13)
+				counters.overflowSamples += 13 - written;
+		}
+		else if (apBlock.numChannels == 384)
+		{
+			// convert to microvolts
+			convertSamples(&packets[packetNum].apData[0][0], apScale.getData(), apBlock.getSample(firstSample), 12, 384);
+			convertSamples(packets[packetNum].lfpData, lfpScale.getData(), lfpBlock.getSample(lfpBlock.numSamples), 1, 384);
 
-}
+			applyProcessingStages(apBlock.getSample(firstSample), lfpBlock.getSample(lfpBlock.numSamples), firstSample);
+		}
+		else if (!needsFullLayout())
+		{
+			// compact output: convert only the active channels
+			convertSamplesGather(&packets[packetNum].apData[0][0], 384, activeChannels, apScaleCompact.getData(),
+				apBlock.getSample(firstSample), numActiveChannels, 12);
+			convertSamplesGather(packets[packetNum].lfpData, 384, activeChannels, lfpScaleCompact.getData(),
+				lfpBlock.getSample(lfpBlock.numSamples), numActiveChannels, 1);
+		}
+		else
+		{
+			// compact output with full-layout stages: process the whole packet, then keep the active channels
+			convertSamples(&packets[packetNum].apData[0][0], apScale.getData(), apPacketScratch.getData(), 12, 384);
+			convertSamples(packets[packetNum].lfpData, lfpScale.getData(), lfpPacketScratch.getData(), 1, 384);
 
-void Probe::setApFilterState(bool disableHighPass)
-{
-	for (int channel = 0; channel < 384; channel++)
-		np::setAPCornerFrequency(basestation->slot, port, channel, disableHighPass);
+			applyProcessingStages(apPacketScratch.getData(), lfpPacketScratch.getData(), firstSample);
 
-	errorCode = np::writeProbeConfiguration(basestation->slot, port, false);
+			gatherChannels(apPacketScratch.getData(), 384, activeChannels, apBlock.getSample(firstSample), numActiveChannels, 12);
+			gatherChannels(lfpPacketScratch.getData(), 384, activeChannels, lfpBlock.getSample(lfpBlock.numSamples), numActiveChannels, 1);
+		}
 
-	std::cout << "Wrote filter " << int(disableHighPass) << " with error code " << errorCode << std::endl;
-}
+		lfpBlock.numSamples++;
 
-void Probe::setGains(unsigned char apGain, unsigned char lfpGain)
-{
-	for (int channel = 0; channel < 384; channel++)
+	}
+
+	if (rawDataMode)
 	{
-		np::setGain(basestation->slot, port, channel, apGain, lfpGain);
-		apGains.set(channel, int(apGain));
-		lfpGains.set(channel, int(lfpGain));
+		apBlock.numSamples = 0;
+		lfpBlock.numSamples = 0;
 	}
-		
-	errorCode = np::writeProbeConfiguration(basestation->slot, port, false);
+	else
+	{
+		if (channelMajorEnabled && channelDataListeners.size() > 0)
+			processChannelMajor();
 
-	std::cout << "Wrote gain " << int(apGain) << ", " << int(lfpGain) << " with error code " << errorCode << std::endl;
-}
+		apBlock.publish(apBuffer);
+		lfpBlock.publish(lfpBuffer);
+	}
 
+	processingTimeMs += Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - startTicks) * 1000.0;
+}
 
-void Probe::setReferences(np::channelreference_t refId, unsigned char refElectrodeBank)
+void Probe::applyProcessingStages(float* ap, float* lfp, int firstSample)
 {
-	for (int channel = 0; channel < 384; channel++)
-		np::setReference(basestation->slot, port, channel, refId, refElectrodeBank);
+	if (activityMonitoringEnabled && activityResetPending.compareAndSetBool(0, 1))
+		activity.reset();
 
-	errorCode = np::writeProbeConfiguration(basestation->slot, port, false);
-
-	std::cout << "Wrote reference " << int(refId) << ", " << int(refElectrodeBank) << " with error code " << errorCode << std::endl;
-}
+	// re-reference while the superframe is still in cache
+	if (commonReferenceMode == CAR_MEAN)
+		subtractCommonAverage(ap, 12, 384, carMask.getData(), numActiveChannels);
+	else if (commonReferenceMode == CAR_MEDIAN)
+		subtractCommonMedian(ap, 12, 384, activeChannels, numActiveChannels, carScratch.getData());
 
+	if (softwareFilterEnabled)
+		apFilter.process(ap, 12);
 
-void Probe::run()
-{
+	if (spikeDetectionEnabled)
+	{
+		int numSpikes = spikeDetector.process(ap, 12, detectedSpikes, 12 * 384);
 
-	//std::cout << "Thread running." << std::endl;
+		for (int s = 0; s < numSpikes; s++)
+		{
+			int sample = firstSample + detectedSpikes[s].sampleIndex;
 
-	while (!threadShouldExit())
-	{
-		
+			apBlock.eventCodes[sample] |= (uint64(1) << SPIKE_TTL_BIT);
 
-		size_t count = SAMPLECOUNT;
+			spikeBatch[s].sampleNumber = apBlock.timestamps[sample];
+			spikeBatch[s].channel = detectedSpikes[s].channel;
 
-		errorCode = readElectrodeData(
-			basestation->slot,
-			port,
-			&packet[0],
-			&count,
-			count);
+			if (activityMonitoringEnabled)
+				activity.addSpike(detectedSpikes[s].channel);
+		}
 
-		if (errorCode == np::SUCCESS &&
-			count > 0)
-		{
-			float apSamples[384];
-			float lfpSamples[384];
+		if (numSpikes > 0)
+			spikeQueue.write(spikeBatch, numSpikes);
+	}
 
-			for (int packetNum = 0; packetNum < count; packetNum++)
-			{
-				for (int i = 0; i < 12; i++)
-				{
-					eventCode = packet[packetNum].Status[i] >> 6; // AUX_IO<0:13>
+	if (activityMonitoringEnabled)
+	{
+		activity.addApSamples(ap, 12);
+		activity.addLfpSamples(lfp, 1);
+		activity.endBlock(apBlock.timestamps[firstSample + 11]);
+	}
+}
 
-					uint32_t npx_timestamp = packet[packetNum].timestamp[i];
+BasestationReader::BasestationReader(Basestation* bs) :
+	Thread("basestation_" + String(bs->slot)),
+	basestation(bs),
+	mode(ROUND_ROBIN),
+	sweeps(0)
+{
+}
 
-					for (int j = 0; j < 384; j++)
-					{
-						apSamples[j] = float(packet[packetNum].apData[i][j]) * 1.2f / 1024.0f * 1000000.0f / gains[apGains[j]]; // convert to microvolts
+bool BasestationReader::service(Probe* probe)
+{
+	bool readFailed;
 
-						if (i == 0)
-							lfpSamples[j] = float(packet[packetNum].lfpData[j]) * 1.2f / 1024.0f * 1000000.0f / gains[lfpGains[j]]; // convert to microvolts
-					}
+	return probe->readBatch(readFailed) > 0;
+}
 
-					ap_timestamp += 1;
+void BasestationReader::run()
+{
+	int numProbes = basestation->probes.size();
 
-					apBuffer->addToBuffer(apSamples, &ap_timestamp, &eventCode, 1);
+	Array<size_t> packetsAvailable;
+	packetsAvailable.insertMultiple(0, 0, numProbes);
 
-					if (ap_timestamp % 30000 == 0)
-					{
-						size_t packetsAvailable;
-						size_t headroom;
+	sweeps = 0;
 
-						np::getElectrodeDataFifoState(
-							basestation->slot,
-							port,
-							&packetsAvailable,
-							&headroom);
+	basestation->probes[0]->scheduling.applyToCurrentThread(basestation->probes[0]->threadIndex);
 
-						//std::cout << "Basestation " << int(basestation->slot) << ", probe " << int(port) << ", packets: " << packetsAvailable << std::endl;
+	while (!threadShouldExit())
+	{
+		bool receivedData = false;
 
-						fifoFillPercentage = float(packetsAvailable) / float(packetsAvailable + headroom);
-					}
+		if (mode == FIFO_DEPTH)
+		{
+			for (int i = 0; i < numProbes; i++)
+			{
+				size_t available = 0;
+				np::getElectrodeDataFifoState(basestation->slot, basestation->probes[i]->port, &available, nullptr);
+				packetsAvailable.set(i, available);
+			}
 
+			// serve ports from the fullest FIFO to the emptiest
+			for (int served = 0; served < numProbes; served++)
+			{
+				int deepest = -1;
 
+				for (int i = 0; i < numProbes; i++)
+				{
+					if (packetsAvailable[i] > 0 && (deepest < 0 || packetsAvailable[i] > packetsAvailable[deepest]))
+						deepest = i;
 				}
-				lfp_timestamp += 1;
 
-				lfpBuffer->addToBuffer(lfpSamples, &lfp_timestamp, &eventCode, 1);
+				if (deepest < 0)
+					break;
 
+				receivedData |= service(basestation->probes[deepest]);
+				packetsAvailable.set(deepest, 0);
 			}
-
 		}
-		else if (errorCode != np::SUCCESS)
+		else
 		{
-			std::cout << "Error code: " << errorCode << "for Basestation " << int(basestation->slot) << ", probe " << int(port) << std::endl;
+			for (int i = 0; i < numProbes; i++)
+				receivedData |= service(basestation->probes[i]);
 		}
-	}
 
+		sweeps++;
+
+		if (receivedData)
+			readWait.dataReceived();
+		else
+			readWait.wait();
+	}
 }
 
 Headstage::Headstage(Probe* probe_) : probe(probe_)
@@ -403,10 +2071,11 @@ BasestationConnectBoard::BasestationConnectBoard(Basestation* bs) : basestation(
 }
 
 
-Basestation::Basestation(int slot_number) : probesInitialized(false)
+Basestation::Basestation(int slot_number, InventoryCache* inventory_) : inventory(inventory_), probesInitialized(false), readerMode(THREAD_PER_PROBE)
 {
 
 	slot = (unsigned char)slot_number;
+	armed = false;
 
 	errorCode = np::openBS(slot);
 
@@ -449,16 +2118,23 @@ Basestation::Basestation(int slot_number) : probesInitialized(false)
 	syncFrequencies.add(10);
 }
 
-void Basestation::init()
+np::NP_ErrorCode Basestation::init()
 {
 
+	np::NP_ErrorCode result = np::SUCCESS;
+
 	for (int i = 0; i < probes.size(); i++)
 	{
 		std::cout << "Initializing probe " << String(i + 1) << "/" << String(probes.size()) << "...";
 
-		errorCode = np::init(this->slot, probes[i]->port);
-		if (errorCode != np::SUCCESS)
+		np::NP_ErrorCode ec = np::init(this->slot, probes[i]->port);
+		if (ec != np::SUCCESS)
+		{
 			std::cout << "  FAILED!." << std::endl;
+
+			if (result == np::SUCCESS)
+				result = ec;
+		}
 		else
 		{
 			setGains(this->slot, probes[i]->port, 3, 2);
@@ -467,10 +2143,14 @@ void Basestation::init()
 
 	}
 
+	return result;
+
 }
 
 Basestation::~Basestation()
 {
+	reader = nullptr;
+
 	for (int i = 0; i < probes.size(); i++)
 	{
 		errorCode = np::close(slot, probes[i]->port);
@@ -482,26 +2162,26 @@ Basestation::~Basestation()
 void Basestation::setSyncAsInput()
 {
 
-	errorCode = np::setTriggerInput(slot, np::TRIGIN_SW);
-	if (errorCode != np::SUCCESS)
+	np::NP_ErrorCode ec = np::setTriggerInput(slot, np::TRIGIN_SW);
+	if (ec != np::SUCCESS)
 	{
 		printf("Failed to set slot %d trigger as input!\n");
 		return;
 	}
 
-	errorCode = setParameter(np::NP_PARAM_SYNCMASTER, slot);
-	if (errorCode != np::SUCCESS)
+	ec = setParameter(np::NP_PARAM_SYNCMASTER, slot);
+	if (ec != np::SUCCESS)
 	{
 		printf("Failed to set slot %d as sync master!\n");
 		return;
 	}
 
-	errorCode = setParameter(np::NP_PARAM_SYNCSOURCE, np::TRIGIN_SMA);
-	if (errorCode != np::SUCCESS)
+	ec = setParameter(np::NP_PARAM_SYNCSOURCE, np::TRIGIN_SMA);
+	if (ec != np::SUCCESS)
 		printf("Failed to set slot %d SMA as sync source!\n");
 
-	errorCode = setTriggerOutput(slot, np::TRIGOUT_PXI1, np::TRIGIN_SW);
-	if (errorCode != np::SUCCESS)
+	ec = setTriggerOutput(slot, np::TRIGOUT_PXI1, np::TRIGIN_SW);
+	if (ec != np::SUCCESS)
 	{
 		printf("Failed to reset sync on SMA output on slot: %d\n", slot);
 	}
@@ -517,15 +2197,15 @@ Array<int> Basestation::getSyncFrequencies()
 void Basestation::setSyncAsOutput(int freqIndex)
 {
 
-	errorCode = setParameter(np::NP_PARAM_SYNCMASTER, slot);
-	if (errorCode != np::SUCCESS)
+	np::NP_ErrorCode ec = setParameter(np::NP_PARAM_SYNCMASTER, slot);
+	if (ec != np::SUCCESS)
 	{
 		printf("Failed to set slot %d as sync master!\n", slot);
 		return;
 	} 
 
-	errorCode = setParameter(np::NP_PARAM_SYNCSOURCE, np::TRIGIN_SYNCCLOCK);
-	if (errorCode != np::SUCCESS)
+	ec = setParameter(np::NP_PARAM_SYNCSOURCE, np::TRIGIN_SYNCCLOCK);
+	if (ec != np::SUCCESS)
 	{
 		printf("Failed to set slot %d internal clock as sync source!\n", slot);
 		return;
@@ -534,15 +2214,15 @@ void Basestation::setSyncAsOutput(int freqIndex)
 	int freq = syncFrequencies[freqIndex];
 
 	printf("Setting slot %d sync frequency to %d Hz...\n", slot, freq);
-	errorCode = setParameter(np::NP_PARAM_SYNCFREQUENCY_HZ, freq);
-	if (errorCode != np::SUCCESS)
+	ec = setParameter(np::NP_PARAM_SYNCFREQUENCY_HZ, freq);
+	if (ec != np::SUCCESS)
 	{
 		printf("Failed to set slot %d sync frequency to %d Hz!\n", slot, freq);
 		return;
 	}
 
-	errorCode = setTriggerOutput(slot, np::TRIGOUT_SMA, np::TRIGIN_SHAREDSYNC);
-	if (errorCode != np::SUCCESS)
+	ec = setTriggerOutput(slot, np::TRIGOUT_SMA, np::TRIGIN_SHAREDSYNC);
+	if (ec != np::SUCCESS)
 	{
 		printf("Failed to set sync on SMA output on slot: %d\n", slot);
 	}
@@ -560,29 +2240,68 @@ float Basestation::getFillPercentage()
 
 	for (int i = 0; i < getProbeCount(); i++)
 	{
-		//std::cout << "Percentage for probe " << i << ": " << probes[i]->fifoFillPercentage << std::endl;
+		float fill = probes[i]->fifoTelemetry.getCurrentFill();
 
-		if (probes[i]->fifoFillPercentage > perc)
-			perc = probes[i]->fifoFillPercentage;
+		//std::cout << "Percentage for probe " << i << ": " << fill << std::endl;
+
+		if (fill > perc)
+			perc = fill;
 	}
 
 	return perc;
 }
 
-void Basestation::initializeProbes()
+float Basestation::getFillHighWaterMark()
+{
+	float perc = 0.0;
+
+	for (int i = 0; i < getProbeCount(); i++)
+		perc = jmax(perc, probes[i]->fifoTelemetry.getHighWaterMark());
+
+	return perc;
+}
+
+FifoFillSample Basestation::getLatestFillInterval()
+{
+	FifoFillSample combined = { 0.0f, 0.0f, 0.0f };
+
+	for (int i = 0; i < getProbeCount(); i++)
+	{
+		FifoFillSample sample = probes[i]->fifoTelemetry.getLatestInterval();
+
+		combined.minimum = jmax(combined.minimum, sample.minimum);
+		combined.maximum = jmax(combined.maximum, sample.maximum);
+		combined.mean = jmax(combined.mean, sample.mean);
+	}
+
+	return combined;
+}
+
+void Basestation::initializeProbes(ProbeInitializationListener* listener)
 {
+	// runs concurrently for several slots, so every result is kept local
+	np::NP_ErrorCode ec;
+
 	if (!probesInitialized)
 	{
-		errorCode = np::setTriggerInput(slot, np::TRIGIN_SW);
+		ec = np::setTriggerInput(slot, np::TRIGIN_SW);
+
+		if (ec != np::SUCCESS)
+			std::cout << "Failed to set slot " << int(slot) << " trigger input, error code " << ec << std::endl;
 
 		for (int i = 0; i < probes.size(); i++)
 		{
-			errorCode = np::setOPMODE(slot, probes[i]->port, np::RECORDING);
-			errorCode = np::setHSLed(slot, probes[i]->port, false);
+			ec = np::setOPMODE(slot, probes[i]->port, np::RECORDING);
 
-			probes[i]->calibrate();
+			if (ec == np::SUCCESS)
+				ec = np::setHSLed(slot, probes[i]->port, false);
 
-			if (errorCode == np::SUCCESS)
+			np::NP_ErrorCode calibrationResult = probes[i]->calibrate();
+
+			if (ec == np::SUCCESS)
+				ec = calibrationResult;
+
+			if (ec == np::SUCCESS)
 			{
 				std::cout << "     Probe initialized." << std::endl;
 				probes[i]->ap_timestamp = 0;
@@ -591,17 +2310,23 @@ void Basestation::initializeProbes()
 				probes[i]->setStatus(ProbeStatus::CONNECTED);
 			}
 			else {
-				std::cout << "     Failed with error code " << errorCode << std::endl;
+				std::cout << "     Failed with error code " << ec << std::endl;
 			}
 
+			if (listener != nullptr)
+				listener->probeInitialized(probes[i], ec == np::SUCCESS);
+
 		}
 
 		probesInitialized = true;
 	}
 
-	errorCode = np::arm(slot);
+	ec = np::arm(slot);
+	armed = ec == np::SUCCESS;
+
+	if (!armed)
+		std::cout << "Failed to arm slot " << int(slot) << ", error code " << ec << std::endl;
 
-	
 }
 
 void Basestation::startAcquisition()
@@ -611,25 +2336,126 @@ void Basestation::startAcquisition()
 		std::cout << "Probe " << int(probes[i]->port) << " setting timestamp to 0" << std::endl;
 		probes[i]->ap_timestamp = 0;
 		probes[i]->lfp_timestamp = 0;
+		probes[i]->apClock.reset();
+		probes[i]->counters.reset();
+		probes[i]->readWait.resetStatistics();
+		probes[i]->readSize.reset();
+		probes[i]->fifoTelemetry.reset();
+		probes[i]->apFilter.reset();
+		probes[i]->spikeDetector.reset();
+		probes[i]->spikeQueue.clear();
 		//std::cout << "... and clearing buffers" << std::endl;
 		probes[i]->apBuffer->clear();
 		probes[i]->lfpBuffer->clear();
-		std::cout << "  Starting thread." << std::endl;
-		probes[i]->startThread();
+		if (probes[i]->rawDataMode)
+		{
+			probes[i]->apRawBuffer->clear();
+			probes[i]->lfpRawBuffer->clear();
+		}
+		if (probes[i]->pipelined)
+		{
+			probes[i]->packetRing->clear();
+			probes[i]->ringFullEvents = 0;
+			probes[i]->converter->convertWait = probes[i]->readWait;
+			probes[i]->converter->convertWait.resetStatistics();
+			std::cout << "  Starting converter thread." << std::endl;
+			probes[i]->converter->startThread();
+		}
+		if (readerMode == THREAD_PER_PROBE)
+		{
+			std::cout << "  Starting thread." << std::endl;
+			probes[i]->startThread();
+		}
+	}
+
+	if (readerMode != THREAD_PER_PROBE && probes.size() > 0)
+	{
+		if (reader == nullptr)
+			reader = new BasestationReader(this);
+
+		reader->mode = readerMode;
+		reader->readWait = probes[0]->readWait;
+		reader->readWait.resetStatistics();
+
+		std::cout << "  Starting basestation reader thread." << std::endl;
+		reader->startThread();
 	}
 
-	errorCode = np::setSWTrigger(slot);
+	np::NP_ErrorCode ec = np::setSWTrigger(slot);
+	armed = false;
+
+	if (ec != np::SUCCESS)
+		std::cout << "Failed to trigger slot " << int(slot) << ", error code " << ec << std::endl;
 
 }
 
 void Basestation::stopAcquisition()
 {
+	if (reader != nullptr && reader->isThreadRunning())
+	{
+		reader->stopThread(1000);
+
+		std::cout << "Basestation " << int(slot) << " reader: " << reader->sweeps << " sweeps, "
+			<< reader->readWait.getStatistics() << std::endl;
+	}
+
 	for (int i = 0; i < probes.size(); i++)
 	{
 		probes[i]->stopThread(1000);
+
+		std::cout << "Probe " << int(probes[i]->port) << " link status:" << std::endl
+			<< probes[i]->counters.toString() << std::endl;
+
+		std::cout << "Probe " << int(probes[i]->port) << " read loop: " << probes[i]->readWait.getStatistics()
+			<< ", peak FIFO fill " << probes[i]->fifoTelemetry.getHighWaterMark() * 100.0f << "%"
+			<< ", largest read size " << probes[i]->readSize.maxSizeUsed << " packets"
+			<< ", processing time " << probes[i]->processingTimeMs << " ms" << std::endl;
+
+		if (probes[i]->spikeDetectionEnabled && probes[i]->spikeQueue.droppedEvents.get() > 0)
+			std::cout << "Probe " << int(probes[i]->port) << " dropped " << probes[i]->spikeQueue.droppedEvents.get()
+				<< " spike events (queue full)" << std::endl;
+
+		if (probes[i]->pipelined)
+		{
+			probes[i]->converter->stopThread(1000);
+
+			std::cout << "Probe " << int(probes[i]->port) << " converter: " << probes[i]->converter->convertWait.getStatistics()
+				<< ", packet ring full " << probes[i]->ringFullEvents.get() << " times" << std::endl;
+		}
 	}
 
-	errorCode = np::arm(slot);
+	np::NP_ErrorCode ec = np::arm(slot);
+	armed = ec == np::SUCCESS;
+
+	if (!armed)
+		std::cout << "Failed to re-arm slot " << int(slot) << ", error code " << ec << std::endl;
+}
+
+bool Basestation::isArmed() const
+{
+	return armed;
+}
+
+void Basestation::setReaderMode(ReaderMode mode)
+{
+	readerMode = mode;
+}
+
+ReaderMode Basestation::getReaderMode() const
+{
+	return readerMode;
+}
+
+void Basestation::applyConfiguration(unsigned char slot_, signed char port, const ProbeConfig& config)
+{
+	if (slot == slot_)
+	{
+		for (int i = 0; i < probes.size(); i++)
+		{
+			if (probes[i]->port == port)
+				probes[i]->applyConfiguration(config);
+		}
+	}
 }
 
 void Basestation::setChannels(unsigned char slot_, signed char port, Array<int> channelMap)
@@ -647,6 +2473,51 @@ void Basestation::setChannels(unsigned char slot_, signed char port, Array<int>
 	}
 }
 
+void Basestation::setCommonReference(unsigned char slot_, signed char port, CommonReferenceMode mode)
+{
+	if (slot == slot_)
+	{
+		for (int i = 0; i < probes.size(); i++)
+		{
+			if (probes[i]->port == port)
+			{
+				probes[i]->setCommonReference(mode);
+				std::cout << "Set common reference to " << int(mode) << std::endl;
+			}
+		}
+	}
+}
+
+void Basestation::setSpikeDetection(unsigned char slot_, signed char port, bool enabled, float thresholdScale)
+{
+	if (slot == slot_)
+	{
+		for (int i = 0; i < probes.size(); i++)
+		{
+			if (probes[i]->port == port)
+			{
+				probes[i]->setSpikeDetection(enabled, thresholdScale);
+				std::cout << "Set spike detection to " << int(enabled) << ", threshold " << thresholdScale << std::endl;
+			}
+		}
+	}
+}
+
+void Basestation::setSoftwareFilter(unsigned char slot_, signed char port, bool enabled)
+{
+	if (slot == slot_)
+	{
+		for (int i = 0; i < probes.size(); i++)
+		{
+			if (probes[i]->port == port)
+			{
+				probes[i]->setSoftwareFilter(enabled);
+				std::cout << "Set software filter to " << int(enabled) << std::endl;
+			}
+		}
+	}
+}
+
 void Basestation::setApFilterState(unsigned char slot_, signed char port, bool disableHighPass)
 {
 	if (slot == slot_)
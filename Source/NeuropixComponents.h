@@ -29,14 +29,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 
 #include "neuropix-api/NeuropixAPI.h"
+#include "NeuropixDsp.h"
 
 
-# define SAMPLECOUNT 64
+# define SAMPLECOUNT 64      // initial number of packets per read
+# define MIN_SAMPLECOUNT 4   // read size when the FIFO is near empty (low latency)
+# define MAX_SAMPLECOUNT 256 // read size when catching up on a backlog (throughput)
 
 class BasestationConnectBoard;
+class BasestationReader;
 class Flex;
 class Headstage;
 class Probe;
+class ProbeInitializationListener;
+class InventoryCache;
 
 class NeuropixComponent
 {
@@ -56,15 +62,77 @@ public:
 	void getInfo();
 };
 
+/** Hardware FIFO fill (0 - 1) over one telemetry interval. */
+struct FifoFillSample
+{
+	float minimum;
+	float maximum;
+	float mean;
+};
+
+/** Digital re-referencing applied to the AP band on the probe thread. */
+enum CommonReferenceMode {
+	CAR_NONE,
+	CAR_MEAN,
+	CAR_MEDIAN
+};
+
+/** A set of probe settings applied together with a single configuration write.
+
+	Each setter records one change; Probe::applyConfiguration makes the per-channel
+	API calls for every recorded change and then writes the shift registers once.
+*/
+class ProbeConfig
+{
+public:
+	ProbeConfig();
+
+	void setChannels(Array<int> channelStatus);
+	void setGains(unsigned char apGain, unsigned char lfpGain);
+	void setReferences(np::channelreference_t refId, unsigned char refElectrodeBank);
+	void setApFilterState(bool disableHighPass);
+
+	/** Returns true if no changes have been recorded. */
+	bool isEmpty() const;
+
+	/** Takes over every change recorded in a newer transaction, keeping the rest of this one. */
+	void merge(const ProbeConfig& newer);
+
+	bool hasChannels;
+	Array<int> channelStatus;
+
+	bool hasGains;
+	unsigned char apGain;
+	unsigned char lfpGain;
+
+	bool hasReferences;
+	np::channelreference_t refId;
+	unsigned char refElectrodeBank;
+
+	bool hasFilter;
+	bool disableHighPass;
+};
+
+/** How the probes of a basestation are read during acquisition. */
+enum ReaderMode {
+	THREAD_PER_PROBE, // each Probe runs its own read loop (default)
+	ROUND_ROBIN,      // a single BasestationReader polls the ports in turn
+	FIFO_DEPTH        // a single BasestationReader serves the port with the fullest FIFO first
+};
+
 class Basestation : public NeuropixComponent
 {
 public:
-	Basestation(int slot);
+	Basestation(int slot, InventoryCache* inventory = nullptr);
 	~Basestation();
 
 	unsigned char slot;
 
-	void init();
+	/** Cached hardware details used to skip EEPROM reads at startup; may be null. */
+	InventoryCache* inventory;
+
+	/** Initializes every probe; returns the first failure, or SUCCESS. */
+	np::NP_ErrorCode init();
 
 	int getProbeCount();
 
@@ -74,7 +142,9 @@ public:
 
 	OwnedArray<Probe> probes;
 
-	void initializeProbes();
+	/** Configures and calibrates every probe once, then arms the basestation. May run on a worker
+		thread; the listener, if given, is called as each probe finishes. */
+	void initializeProbes(ProbeInitializationListener* listener = nullptr);
 
 	float getTemperature();
 
@@ -82,6 +152,10 @@ public:
 	void setReferences(unsigned char slot, signed char port, np::channelreference_t refId, unsigned char electrodeBank);
 	void setGains(unsigned char slot, signed char port, unsigned char apGain, unsigned char lfpGain);
 	void setApFilterState(unsigned char slot, signed char port, bool filterState);
+	void applyConfiguration(unsigned char slot, signed char port, const ProbeConfig& config);
+	void setCommonReference(unsigned char slot, signed char port, CommonReferenceMode mode);
+	void setSoftwareFilter(unsigned char slot, signed char port, bool enabled);
+	void setSpikeDetection(unsigned char slot, signed char port, bool enabled, float thresholdScale);
 
 	void getInfo();
 
@@ -97,11 +171,27 @@ public:
 	File getSavingDirectory();
 
 	float getFillPercentage();
-	
+
+	/** Returns the highest FIFO fill reached by any probe since acquisition started. */
+	float getFillHighWaterMark();
+
+	/** Returns the most recent telemetry interval, combined across probes (largest values). */
+	FifoFillSample getLatestFillInterval();
+
+	void setReaderMode(ReaderMode mode);
+	ReaderMode getReaderMode() const;
+
+	/** Returns true once the basestation has been armed and is waiting for its start trigger. */
+	bool isArmed() const;
 
 private:
+	bool armed;
+
 	bool probesInitialized;
 
+	ReaderMode readerMode;
+	ScopedPointer<BasestationReader> reader;
+
 	Array<int> syncFrequencies;
 
 	File savingDirectory;
@@ -118,6 +208,486 @@ public:
 	void getInfo();
 };
 
+/** On-disk record of the hardware found at each slot and port.
+
+	Components read one serial number and, if it matches the cached entry, take their
+	versions and part numbers from the cache instead of reading them over I2C.
+*/
+class InventoryCache
+{
+public:
+	InventoryCache();
+
+	/** Returns the cached entry for a probe if the serial number still matches, otherwise nullptr. */
+	XmlElement* findProbe(unsigned char slot, signed char port, uint64_t serialNumber);
+
+	/** Returns the cached entry for a basestation connect board if the serial number still matches. */
+	XmlElement* findConnectBoard(unsigned char slot, uint64_t serialNumber);
+
+	/** Records the details of a probe, its headstage and flex. */
+	void storeProbe(Probe* probe);
+
+	/** Records the details of a basestation connect board. */
+	void storeConnectBoard(BasestationConnectBoard* board);
+
+	/** Writes the cache back to disk if any entry changed. */
+	void save();
+
+	int hits;
+	int misses;
+
+private:
+	XmlElement* getSlot(unsigned char slot);
+
+	File file;
+	ScopedPointer<XmlElement> xml;
+	bool changed;
+};
+
+/** Staging area for one batch of samples, published to a DataBuffer with a single addToBuffer call. */
+class SampleBlock
+{
+public:
+	SampleBlock(int numChannels, int maxSamples);
+
+	float* getSample(int index) { return data.getData() + index * numChannels; }
+
+	/** Adds the staged samples to the buffer and empties the block. */
+	void publish(DataBuffer* buffer);
+
+	AlignedFloatBuffer data;
+	HeapBlock<int64> timestamps;
+	HeapBlock<uint64> eventCodes;
+
+	int numChannels;
+	int maxSamples;
+	int numSamples;
+};
+
+/** Single-producer, single-consumer ring of unscaled int16 samples.
+
+	Used in raw data mode: the probe thread copies samples straight out of the
+	electrode packets, and NeuropixThread::updateBuffer moves them into the
+	DataBuffer, where the microvolt scale is applied lazily via the channel bitVolts.
+*/
+class RawSampleBuffer
+{
+public:
+	RawSampleBuffer(int numChannels, int size);
+
+	void clear();
+
+	/** Copies numSamples rows of numChannels values; returns the number of rows written. */
+	int write(const int16_t* samples, const int64* timestamps, const uint64* eventCodes, int numSamples);
+
+	/** Moves all available rows into the DataBuffer; returns the number of rows moved. */
+	int publishTo(DataBuffer* buffer);
+
+private:
+	AbstractFifo fifo;
+
+	HeapBlock<int16_t> samples;
+	HeapBlock<int64> timestamps;
+	HeapBlock<uint64> eventCodes;
+
+	AlignedFloatBuffer unitScale;
+	SampleBlock outputBlock;
+
+	int numChannels;
+};
+
+#define NUM_ADCS 32 // ADCs per probe, each with its own calibration record
+#define ADC_CACHE_MAGIC 0x4341504e // "NPAC"
+#define ADC_CACHE_VERSION 1
+
+#define SPIKE_TTL_BIT 10 // event code bit raised on AP samples where any channel crossed threshold; first bit above Status >> 6
+
+/** A detected spike, in the probe's AP sample numbering. */
+struct ProbeSpikeEvent
+{
+	int64 sampleNumber;
+	int channel;
+};
+
+/** Single-producer, single-consumer queue of detected spikes.
+
+	Written by the thread that processes the probe's packets; events that do not fit
+	are dropped and counted rather than blocking acquisition.
+*/
+class SpikeEventQueue
+{
+public:
+	SpikeEventQueue(int size);
+
+	void clear();
+
+	void write(const ProbeSpikeEvent* events, int numEvents);
+
+	/** Copies up to maxEvents of the oldest events into dest; returns the number copied. */
+	int read(ProbeSpikeEvent* dest, int maxEvents);
+
+	Atomic<int64> droppedEvents;
+
+private:
+	AbstractFifo fifo;
+	HeapBlock<ProbeSpikeEvent> events;
+};
+
+/** Per-channel activity summary over one monitoring interval. */
+struct ChannelActivitySnapshot
+{
+	float apRms[384];       // microvolts, mean removed
+	float lfpPower[384];    // microvolts squared, mean removed
+	float spikeRate[384];   // Hz; zero unless spike detection is enabled
+	int64 sampleNumber;     // AP sample number at the end of the interval
+};
+
+/**
+	Decimated per-channel summaries of a probe's data, for the probe view.
+
+	The acquisition thread accumulates AP and LFP moments and spike counts, and every
+	samplesPerSnapshot AP samples publishes a snapshot into one half of a double buffer.
+	Readers copy the last published half without locking and retry if the writer has
+	started overwriting it in the meantime.
+*/
+class ChannelActivityMonitor
+{
+public:
+	ChannelActivityMonitor();
+
+	void reset();
+
+	void addApSamples(const float* samples, int numSamples);
+	void addLfpSamples(const float* samples, int numSamples);
+	void addSpike(int channel) { spikeCounts[channel]++; }
+
+	/** Publishes a snapshot if the interval is complete; sampleNumber is the last AP sample added. */
+	void endBlock(int64 sampleNumber);
+
+	/** Copies the latest snapshot; returns false if none has been published yet. */
+	bool getSnapshot(ChannelActivitySnapshot& dest) const;
+
+	int samplesPerSnapshot;
+
+private:
+	AlignedFloatBuffer apSums;
+	AlignedFloatBuffer apSumSquares;
+	AlignedFloatBuffer lfpSums;
+	AlignedFloatBuffer lfpSumSquares;
+	int spikeCounts[384];
+
+	int apSamples;
+	int lfpSamples;
+
+	ChannelActivitySnapshot snapshots[2];
+	Atomic<int> version;
+};
+
+#define MAX_TIMESTAMP_STEP 300000 // largest plausible gap between hardware timestamps, 10 s of AP samples
+
+/** Lock-free packet and link-error counters for one probe.
+
+	Updated by the acquisition thread, read by the GUI at any time.
+*/
+class PacketCounters
+{
+public:
+	PacketCounters();
+
+	void reset();
+
+	/** Counts the error bits set in one sample's packet status word. */
+	void addStatus(uint16_t status)
+	{
+		if ((status & errorMask) != 0)
+			addErrors(status);
+	}
+
+	/** Records the step between two consecutive hardware timestamps; steps outside 1..MAX_TIMESTAMP_STEP count as discontinuities. */
+	void addTimestampStep(int32_t step);
+
+	/** Returns the total number of link errors, gaps and read failures. */
+	int64 getTotalErrors() const;
+
+	String toString() const;
+
+	Atomic<int64> packets;
+	Atomic<int64> readErrors;
+
+	Atomic<int64> countErrors;
+	Atomic<int64> serdesErrors;
+	Atomic<int64> lockErrors;
+	Atomic<int64> popErrors;
+	Atomic<int64> syncErrors;
+
+	Atomic<int64> timestampGaps;
+	Atomic<int64> missedSamples;
+	Atomic<int64> discontinuities;
+
+	Atomic<int64> overflowSamples; // raw mode: samples rejected by a full RawSampleBuffer
+
+private:
+	void addErrors(uint16_t status);
+
+	static const uint16_t errorMask = ELECTRODEPACKET_STATUS_ERR_COUNT | ELECTRODEPACKET_STATUS_ERR_SERDES |
+		ELECTRODEPACKET_STATUS_ERR_LOCK | ELECTRODEPACKET_STATUS_ERR_POP | ELECTRODEPACKET_STATUS_ERR_SYNC;
+};
+
+/** Derives 64-bit sample numbers from the 32-bit hardware timestamps.
+
+	Counter roll-over is unwrapped by accumulating the signed difference between
+	consecutive timestamps, so the clock stays valid over arbitrarily long sessions.
+	Steps other than one sample are reported to the probe's PacketCounters. Only steps of
+	1..MAX_TIMESTAMP_STEP move the clock by the step; a backwards or implausibly large step
+	(e.g. a timestamp corrupted by a SERDES error) advances it by one sample, and counting
+	resumes from the new timestamp, so the sample numbers stay monotonic.
+*/
+class SampleClock
+{
+public:
+	SampleClock();
+
+	void reset();
+
+	/** Returns the sample number for a hardware timestamp; the first timestamp after reset maps to firstSampleNumber. */
+	int64 getSampleNumber(uint32_t timestamp, int64 firstSampleNumber, PacketCounters& counters);
+
+private:
+	bool started;
+	uint32_t lastTimestamp;
+	int64 sampleNumber;
+};
+
+/** Wait strategy for an acquisition loop whose last read returned no packets.
+
+	Spins for the first few empty reads, then yields, then sleeps for roughly
+	the time the hardware needs to produce sleepPackets new packets (one
+	packet of 12 AP samples arrives every 0.4 ms). Setting sleepPackets to 0
+	disables sleeping, which restores a pure busy loop.
+*/
+class AdaptiveWait
+{
+public:
+	AdaptiveWait();
+
+	/** Called after a read that returned packets. */
+	void dataReceived() { emptyReads = 0; }
+
+	/** Called after a read that returned no packets. */
+	void wait();
+
+	void resetStatistics();
+	String getStatistics() const;
+
+	int spinCount;
+	int yieldCount;
+	int sleepPackets;
+
+	int64 spins;
+	int64 yields;
+	int64 sleeps;
+	int64 sleepTimeMs;
+
+private:
+	int emptyReads;
+};
+
+/** Chooses how many packets to request from readElectrodeData.
+
+	The read size doubles (up to MAX_SAMPLECOUNT) while the FIFO reports more
+	packets waiting than one read can take, and halves (down to MIN_SAMPLECOUNT)
+	while reads come back mostly empty.
+*/
+class AdaptiveReadSize
+{
+public:
+	AdaptiveReadSize();
+
+	void reset();
+
+	int getSize() const { return size; }
+
+	/** Returns true if the FIFO state should be queried after a read that returned packetsRead packets. */
+	bool needsFifoState(size_t packetsRead) const { return packetsRead >= size_t(size); }
+
+	/** Updates the read size; packetsAvailable is only used after a full read. */
+	void update(size_t packetsRead, size_t packetsAvailable);
+
+	int maxSizeUsed;
+
+private:
+	int size;
+};
+
+/**
+	FIFO fill history for one probe.
+
+	Measurements are added by the FifoTelemetryMonitor thread only; the current fill,
+	high-water mark and interval history can be read from any thread without locking.
+	History slots are written before the interval count is published, so a reader sees
+	complete samples as long as it is not lapped by a full ring of intervals.
+*/
+class FifoTelemetry
+{
+public:
+	FifoTelemetry();
+
+	void reset();
+
+	/** Adds one FIFO fill measurement to the current interval. */
+	void addMeasurement(float fill);
+
+	/** Closes the current interval and appends its min/max/mean to the history. */
+	void endInterval();
+
+	float getCurrentFill() const { return currentFill.get(); }
+	float getHighWaterMark() const { return highWaterMark.get(); }
+
+	/** Returns the most recent interval, or an empty sample if none has completed. */
+	FifoFillSample getLatestInterval() const;
+
+	/** Copies the completed intervals into history, oldest first. */
+	void getHistory(Array<FifoFillSample>& history) const;
+
+	enum { historySize = 120 };
+
+private:
+	FifoFillSample intervals[historySize];
+	Atomic<int> numIntervals;
+
+	Atomic<float> currentFill;
+	Atomic<float> highWaterMark;
+
+	float intervalMin;
+	float intervalMax;
+	float intervalSum;
+	int intervalCount;
+};
+
+/** Polls the FIFO state of every probe at a low rate and feeds their FifoTelemetry. */
+class FifoTelemetryMonitor : public Thread
+{
+public:
+	FifoTelemetryMonitor(const Array<Probe*>& probes);
+
+	void run();
+
+	int pollIntervalMs;
+	int measurementsPerInterval;
+
+private:
+	Array<Probe*> probes;
+};
+
+/**
+	Scheduling settings for the acquisition threads (probe threads and basestation readers).
+
+	Applied by each thread to itself when it starts. With an affinity mask set, threads
+	either share all of its cores or, with spreadAcrossCores, are each pinned to one of
+	them in turn. On Linux, realtime selects the SCHED_FIFO policy (this needs
+	CAP_SYS_NICE or a suitable rtprio limit); elsewhere it raises the thread to the
+	highest JUCE priority.
+*/
+class ThreadSchedulingOptions
+{
+public:
+	ThreadSchedulingOptions();
+
+	/** Applies the settings to the calling thread; threadIndex selects the core when spreading. */
+	void applyToCurrentThread(int threadIndex) const;
+
+	/** Keeps the calling thread off the cores reserved for acquisition, if isolation is enabled. */
+	void isolateCurrentThread() const;
+
+	/** Returns the mask of the core assigned to threadIndex, or the whole mask when not spreading. */
+	uint32 getAffinityMask(int threadIndex) const;
+
+	int priority;            // JUCE priority, 0 - 10
+	bool realtime;
+	uint32 affinityMask;     // 0 = no pinning
+	bool spreadAcrossCores;
+	bool isolateMainThread;  // keeps NeuropixThread off the acquisition cores
+};
+
+#define PACKET_RING_SIZE 1024 // electrode packets, ~0.4 s of data
+
+/** Single-producer, single-consumer ring of electrode packets.
+
+	In pipelined mode the probe's reader writes packets straight from the hardware
+	into the ring, and its PacketConverter thread converts and publishes them. Both
+	sides work on contiguous blocks of the preallocated storage, so neither copies,
+	allocates or locks.
+*/
+class PacketRing
+{
+public:
+	PacketRing(int size);
+
+	void clear();
+
+	/** Returns the first contiguous free block; numPackets receives its size (at most maxPackets). */
+	np::electrodePacket* getWriteBlock(int maxPackets, int& numPackets);
+	void finishedWrite(int numPackets);
+
+	/** Returns the first contiguous block of unread packets; numPackets receives its size (at most maxPackets). */
+	const np::electrodePacket* getReadBlock(int maxPackets, int& numPackets);
+	void finishedRead(int numPackets);
+
+private:
+	AbstractFifo fifo;
+	HeapBlock<np::electrodePacket> packets;
+};
+
+/** Converts and publishes the packets a probe's reader has queued in its PacketRing. */
+class PacketConverter : public Thread
+{
+public:
+	PacketConverter(Probe* probe);
+
+	void run();
+
+	AdaptiveWait convertWait;
+
+private:
+	Probe* probe;
+};
+
+/** Receives each batch of AP samples in channel-major layout. */
+class ChannelDataListener
+{
+public:
+	virtual ~ChannelDataListener() {}
+
+	/** Called on the thread that processes the probe's packets, once per batch.
+
+		data holds numChannels rows of numSamples microvolt values, stride floats apart;
+		timestamps holds the sample number of each column.
+	*/
+	virtual void channelDataReady(Probe* probe, const float* data, int stride, int numChannels, int numSamples, const int64* timestamps) = 0;
+};
+
+/** Receives progress from Basestation::initializeProbes. */
+class ProbeInitializationListener
+{
+public:
+	virtual ~ProbeInitializationListener() {}
+
+	/** Called on the initializing thread when a probe has been configured and calibrated. */
+	virtual void probeInitialized(Probe* probe, bool success) = 0;
+};
+
+/** Shows the missing calibration file warning on the message thread. */
+class CalibrationWarning : public CallbackMessage
+{
+public:
+	CalibrationWarning(String message);
+
+	void messageCallback() override;
+
+private:
+	String message;
+};
+
 typedef enum {
 	DISCONNECTED, //There is no communication between probe and computer
 	CONNECTING,   //Computer has detected the probe and is attempting to connect
@@ -140,6 +710,13 @@ public:
 	int64 ap_timestamp;
 	int64 lfp_timestamp;
 
+	/** Derives sample numbers from the hardware timestamps instead of counting received samples. */
+	void setHardwareClock(bool useHardwareClock);
+	bool useHardwareClock;
+	SampleClock apClock;
+
+	PacketCounters counters;
+
 	ScopedPointer<Headstage> headstage;
 	ScopedPointer<Flex> flex;
 
@@ -166,7 +743,44 @@ public:
 	void setReferences(np::channelreference_t refId, unsigned char refElectrodeBank);
 	void setGains(unsigned char apGain, unsigned char lfpGain);
 
-	void calibrate();
+	/** Applies every change in the transaction, then writes the probe configuration once.
+		Returns the result of the write. */
+	np::NP_ErrorCode applyConfiguration(const ProbeConfig& config);
+
+	/** Per-channel API calls for each setting, without writing the configuration. */
+	void stageChannels(const Array<int>& channelStatus);
+	void stageApFilterState(bool disableHighPass);
+	void stageReferences(np::channelreference_t refId, unsigned char refElectrodeBank);
+	void stageGains(unsigned char apGain, unsigned char lfpGain);
+
+	/** Writes the staged settings to the probe's shift registers; does nothing if no setting changed. */
+	np::NP_ErrorCode writeConfiguration();
+
+	/** Forgets the last-applied settings, so the next change of each setting goes to every channel. */
+	void invalidateConfiguration();
+
+	/** Last-applied state: channelMap, apGains and lfpGains hold the per-channel values once the
+		matching flag is set, and the stage methods only call the API for channels that differ. */
+	bool channelMapApplied;
+	bool gainsApplied;
+	bool referencesApplied;
+	bool filterApplied;
+	bool configurationDirty;
+
+	np::channelreference_t appliedRefId;
+	unsigned char appliedRefElectrodeBank;
+	bool appliedFilterState;
+
+	/** Loads the ADC and gain calibration; returns the result of the final configuration write,
+		or SUCCESS if no calibration files exist. */
+	np::NP_ErrorCode calibrate();
+
+	/** Loads the ADC parameters from the binary cache next to the calibration CSV; returns false
+		if the cache is missing, stale (CSV size or time changed, other probe) or corrupt. */
+	bool loadAdcCalibrationCache(const File& csvFile, const File& cacheFile);
+
+	/** Reads the ADC parameters back from the API and writes them to the binary cache. */
+	void saveAdcCalibrationCache(const File& csvFile, const File& cacheFile);
 
 	void setStatus(ProbeStatus);
 	ProbeStatus status;
@@ -176,19 +790,185 @@ public:
 
 	void getInfo();
 
+	/** Inventory entry matching this probe's serial number, or nullptr if the details were read from hardware. */
+	XmlElement* cachedInventory;
+
 	int channel_count;
 
-	float fifoFillPercentage;
+	FifoTelemetry fifoTelemetry;
+
+	AdaptiveWait readWait;
+
+	ThreadSchedulingOptions scheduling;
+	int threadIndex;
 
 	String name;
 
 	void run();
 
+	/** Reads one batch from the hardware FIFO and either processes it or, when pipelined, queues it
+		for the converter thread; returns the number of packets read. */
+	size_t readBatch(bool& readFailed);
+
+	/** Reads up to maxPackets packets from the hardware FIFO into dest; returns the number read. */
+	size_t readPackets(np::electrodePacket* dest, size_t maxPackets, bool& readFailed);
+
+	/** Converts and publishes a block of packets. */
+	void processPackets(const np::electrodePacket* packets, size_t count);
+
+	/** Time spent in processPackets since acquisition started, for comparing reader modes. */
+	double processingTimeMs;
+
 	uint64 eventCode;
 	Array<int> gains;
 
-	np::electrodePacket packet[SAMPLECOUNT];
+	/** Rebuilds the per-channel microvolt scale factors from the current gain settings. */
+	void updateScaleTables();
+
+	AlignedFloatBuffer apScale;
+	AlignedFloatBuffer lfpScale;
+
+	/** Applies the per-electrode gain correction from the calibration CSV in the scale tables
+		instead of in the basestation FPGA, which is loaded with unity factors meanwhile. */
+	void setSoftwareGainCorrection(bool enabled);
+	bool softwareGainCorrection;
+
+	/** Returns true if the gain correction is folded into the scale tables; never in raw data mode. */
+	bool isGainCorrectedInSoftware() const;
+
+	/** Reads the gain correction factors from a _gainCalValues.csv file; returns false if none were found. */
+	bool loadGainCorrection(const File& csvFile);
+
+	/** Loads the gain calibration into the FPGA: the real factors, or unity in software correction mode. */
+	void uploadGainCalibration();
+
+	File gainCalibrationFile;
+	String gainCalibrationHeader;
+	bool gainCorrectionLoaded;
+
+	HeapBlock<float> apGainCorrection; // [electrode * 8 + gain index]
+	HeapBlock<float> lfpGainCorrection;
+
+	SampleBlock apBlock;
+	SampleBlock lfpBlock;
 
+	/** Keeps samples as int16 until they are moved into the DataBuffers by NeuropixThread.
+		The processing stages (CAR, software filter, spike detection, activity) are skipped in this mode,
+		and software gain correction is left to the FPGA so each band has a single scale. */
+	void setRawDataMode(bool rawDataMode);
+	bool rawDataMode;
+
+	ScopedPointer<RawSampleBuffer> apRawBuffer;
+	ScopedPointer<RawSampleBuffer> lfpRawBuffer;
+
+	AdaptiveReadSize readSize;
+	HeapBlock<np::electrodePacket> packet;
+
+	/** Runs threshold-crossing spike detection on the AP band; thresholdScale is in multiples of the noise level. */
+	void setSpikeDetection(bool enabled, float thresholdScale);
+	bool spikeDetectionEnabled;
+
+	SpikeDetector spikeDetector;
+	HeapBlock<SpikeEvent> detectedSpikes;
+	HeapBlock<ProbeSpikeEvent> spikeBatch;
+	SpikeEventQueue spikeQueue;
+
+	/** Maintains the per-channel activity snapshot for the probe view while enabled. */
+	void setActivityMonitoring(bool enabled);
+	bool activityMonitoringEnabled;
+	ChannelActivityMonitor activity;
+	Atomic<int> activityResetPending; // set by setActivityMonitoring, consumed by the processing thread
+
+	/** Applies a 300 - 6000 Hz software bandpass to the AP band (use with the hardware highpass disabled). */
+	void setSoftwareFilter(bool enabled);
+	bool softwareFilterEnabled;
+	MultiChannelBiquadCascade apFilter;
+
+	/** Selects the common reference subtracted from the AP band after conversion. */
+	void setCommonReference(CommonReferenceMode mode);
+	CommonReferenceMode commonReferenceMode;
+
+	/** Rebuilds the list of active channels (connected, not the reference site), which forms the
+		common reference and, in compact output mode, the output channels. */
+	void updateActiveChannels();
+
+	HeapBlock<int> activeChannels;
+	int numActiveChannels;
+
+	AlignedFloatBuffer carMask;
+	AlignedFloatBuffer carScratch;
+
+	/** Outputs only the active channels, in channel order, instead of all 384. Ignored in raw data mode. */
+	void setCompactOutput(bool compact);
+	bool compactOutput;
+
+	/** Returns the number of channels per sample sent to the DataBuffers. */
+	int getNumOutputChannels() const;
+
+	/** Returns the probe channel carried by an output channel. */
+	int getOutputChannel(int outputIndex) const;
+
+	/** Sizes the DataBuffers and staging blocks for the current output channels. */
+	void updateOutputLayout();
+
+	AlignedFloatBuffer apScaleCompact;
+	AlignedFloatBuffer lfpScaleCompact;
+	AlignedFloatBuffer apPacketScratch;
+	AlignedFloatBuffer lfpPacketScratch;
+
+	/** Re-referencing, filtering, spike detection and activity monitoring for one packet in full 384-channel layout. */
+	void applyProcessingStages(float* ap, float* lfp, int firstSample);
+
+	/** Returns true if any stage that needs the full channel layout is enabled. */
+	bool needsFullLayout() const;
+
+	/** Also transposes each AP batch into channel-major layout for the ChannelDataListeners.
+		Enabled while at least one listener is registered; the processing stages and the
+		output to the DataBuffer keep using the sample-major block. */
+	void setChannelMajorEnabled(bool enabled);
+	bool channelMajorEnabled;
+
+	AlignedFloatBuffer apChannelMajor;
+	int channelMajorStride;
+
+	/** Listeners must be added or removed while acquisition is stopped. */
+	void addChannelDataListener(ChannelDataListener* listener);
+	void removeChannelDataListener(ChannelDataListener* listener);
+	Array<ChannelDataListener*> channelDataListeners;
+
+	/** Runs the channel-major stage on the AP samples currently in apBlock. */
+	void processChannelMajor();
+
+	/** Hands packets to a separate converter thread, so conversion never delays draining the hardware FIFO. */
+	void setPipelined(bool pipelined);
+	bool pipelined;
+
+	ScopedPointer<PacketRing> packetRing;
+	ScopedPointer<PacketConverter> converter;
+
+	/** Number of reads skipped because the packet ring was full. */
+	Atomic<int64> ringFullEvents;
+
+};
+
+/** Drives all ports of a basestation from a single thread. */
+class BasestationReader : public Thread
+{
+public:
+	BasestationReader(Basestation* basestation);
+
+	void run();
+
+	ReaderMode mode;
+	AdaptiveWait readWait;
+
+	int64 sweeps;
+
+private:
+	/** Reads and processes one batch for a probe; returns true if it received packets. */
+	bool service(Probe* probe);
+
+	Basestation* basestation;
 };
 
 class Headstage : public NeuropixComponent
@@ -0,0 +1,633 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2018 Allen Institute for Brain Science and Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "NeuropixDsp.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NEUROPIX_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NEUROPIX_SSE2 1
+#endif
+
+AlignedFloatBuffer::AlignedFloatBuffer(int size) : data(nullptr), numElements(0)
+{
+	setSize(size);
+}
+
+void AlignedFloatBuffer::setSize(int size)
+{
+	numElements = size;
+
+	storage.calloc(size * sizeof(float) + NEUROPIX_SIMD_ALIGNMENT);
+
+	size_t address = reinterpret_cast<size_t>(storage.getData());
+	size_t offset = (NEUROPIX_SIMD_ALIGNMENT - (address % NEUROPIX_SIMD_ALIGNMENT)) % NEUROPIX_SIMD_ALIGNMENT;
+
+	data = reinterpret_cast<float*>(storage.getData() + offset);
+}
+
+void AlignedFloatBuffer::clear()
+{
+	memset(data, 0, numElements * sizeof(float));
+}
+
+const char* getConversionKernelName()
+{
+#if NEUROPIX_AVX2
+	return "AVX2";
+#elif NEUROPIX_SSE2
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
+
+void convertSamples(const int16_t* src, const float* scale, float* dst, int numSamples, int numChannels)
+{
+	for (int sample = 0; sample < numSamples; sample++)
+	{
+		const int16_t* in = src + sample * numChannels;
+		float* out = dst + sample * numChannels;
+
+		int ch = 0;
+
+#if NEUROPIX_AVX2
+		for (; ch + 16 <= numChannels; ch += 16)
+		{
+			__m256i raw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + ch));
+
+			__m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(raw)));
+			__m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(raw, 1)));
+
+			_mm256_storeu_ps(out + ch, _mm256_mul_ps(lo, _mm256_loadu_ps(scale + ch)));
+			_mm256_storeu_ps(out + ch + 8, _mm256_mul_ps(hi, _mm256_loadu_ps(scale + ch + 8)));
+		}
+#elif NEUROPIX_SSE2
+		for (; ch + 8 <= numChannels; ch += 8)
+		{
+			__m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ch));
+
+			// sign-extend int16 -> int32 by placing each value in the upper half and shifting back down
+			__m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(raw, raw), 16));
+			__m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(raw, raw), 16));
+
+			_mm_storeu_ps(out + ch, _mm_mul_ps(lo, _mm_loadu_ps(scale + ch)));
+			_mm_storeu_ps(out + ch + 4, _mm_mul_ps(hi, _mm_loadu_ps(scale + ch + 4)));
+		}
+#endif
+
+		for (; ch < numChannels; ch++)
+			out[ch] = float(in[ch]) * scale[ch];
+	}
+}
+
+void convertSamplesGather(const int16_t* src, int srcChannels, const int* channels, const float* scale,
+	float* dst, int numOutputChannels, int numSamples)
+{
+	for (int sample = 0; sample < numSamples; sample++)
+	{
+		const int16_t* in = src + sample * srcChannels;
+		float* out = dst + sample * numOutputChannels;
+
+		for (int i = 0; i < numOutputChannels; i++)
+			out[i] = float(in[channels[i]]) * scale[i];
+	}
+}
+
+void gatherChannels(const float* src, int srcChannels, const int* channels, float* dst, int numOutputChannels, int numSamples)
+{
+	for (int sample = 0; sample < numSamples; sample++)
+	{
+		const float* in = src + sample * srcChannels;
+		float* out = dst + sample * numOutputChannels;
+
+		for (int i = 0; i < numOutputChannels; i++)
+			out[i] = in[channels[i]];
+	}
+}
+
+#define TRANSPOSE_TILE 32 // 32 x 32 floats = 4 KB per side, well within L1
+
+static inline void transposeScalar(const float* src, int srcStride, float* dst, int dstStride, int rows, int cols)
+{
+	for (int r = 0; r < rows; r++)
+		for (int c = 0; c < cols; c++)
+			dst[c * dstStride + r] = src[r * srcStride + c];
+}
+
+static void transposeTile(const float* src, int srcStride, float* dst, int dstStride, int rows, int cols)
+{
+	int r = 0;
+
+#if NEUROPIX_AVX2
+	for (; r + 8 <= rows; r += 8)
+	{
+		int c = 0;
+
+		for (; c + 8 <= cols; c += 8)
+		{
+			const float* in = src + r * srcStride + c;
+
+			__m256 r0 = _mm256_loadu_ps(in);
+			__m256 r1 = _mm256_loadu_ps(in + srcStride);
+			__m256 r2 = _mm256_loadu_ps(in + 2 * srcStride);
+			__m256 r3 = _mm256_loadu_ps(in + 3 * srcStride);
+			__m256 r4 = _mm256_loadu_ps(in + 4 * srcStride);
+			__m256 r5 = _mm256_loadu_ps(in + 5 * srcStride);
+			__m256 r6 = _mm256_loadu_ps(in + 6 * srcStride);
+			__m256 r7 = _mm256_loadu_ps(in + 7 * srcStride);
+
+			__m256 t0 = _mm256_unpacklo_ps(r0, r1);
+			__m256 t1 = _mm256_unpackhi_ps(r0, r1);
+			__m256 t2 = _mm256_unpacklo_ps(r2, r3);
+			__m256 t3 = _mm256_unpackhi_ps(r2, r3);
+			__m256 t4 = _mm256_unpacklo_ps(r4, r5);
+			__m256 t5 = _mm256_unpackhi_ps(r4, r5);
+			__m256 t6 = _mm256_unpacklo_ps(r6, r7);
+			__m256 t7 = _mm256_unpackhi_ps(r6, r7);
+
+			__m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+			__m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+			__m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+			__m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+			__m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+			__m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+			__m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+			__m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+			float* out = dst + c * dstStride + r;
+
+			_mm256_storeu_ps(out, _mm256_permute2f128_ps(s0, s4, 0x20));
+			_mm256_storeu_ps(out + dstStride, _mm256_permute2f128_ps(s1, s5, 0x20));
+			_mm256_storeu_ps(out + 2 * dstStride, _mm256_permute2f128_ps(s2, s6, 0x20));
+			_mm256_storeu_ps(out + 3 * dstStride, _mm256_permute2f128_ps(s3, s7, 0x20));
+			_mm256_storeu_ps(out + 4 * dstStride, _mm256_permute2f128_ps(s0, s4, 0x31));
+			_mm256_storeu_ps(out + 5 * dstStride, _mm256_permute2f128_ps(s1, s5, 0x31));
+			_mm256_storeu_ps(out + 6 * dstStride, _mm256_permute2f128_ps(s2, s6, 0x31));
+			_mm256_storeu_ps(out + 7 * dstStride, _mm256_permute2f128_ps(s3, s7, 0x31));
+		}
+
+		transposeScalar(src + r * srcStride + c, srcStride, dst + c * dstStride + r, dstStride, 8, cols - c);
+	}
+#elif NEUROPIX_SSE2
+	for (; r + 4 <= rows; r += 4)
+	{
+		int c = 0;
+
+		for (; c + 4 <= cols; c += 4)
+		{
+			const float* in = src + r * srcStride + c;
+
+			__m128 r0 = _mm_loadu_ps(in);
+			__m128 r1 = _mm_loadu_ps(in + srcStride);
+			__m128 r2 = _mm_loadu_ps(in + 2 * srcStride);
+			__m128 r3 = _mm_loadu_ps(in + 3 * srcStride);
+
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+			float* out = dst + c * dstStride + r;
+
+			_mm_storeu_ps(out, r0);
+			_mm_storeu_ps(out + dstStride, r1);
+			_mm_storeu_ps(out + 2 * dstStride, r2);
+			_mm_storeu_ps(out + 3 * dstStride, r3);
+		}
+
+		transposeScalar(src + r * srcStride + c, srcStride, dst + c * dstStride + r, dstStride, 4, cols - c);
+	}
+#endif
+
+	transposeScalar(src + r * srcStride, srcStride, dst + r, dstStride, rows - r, cols);
+}
+
+void transposeSamples(const float* src, int srcStride, float* dst, int dstStride, int rows, int cols)
+{
+	for (int r = 0; r < rows; r += TRANSPOSE_TILE)
+	{
+		for (int c = 0; c < cols; c += TRANSPOSE_TILE)
+		{
+			transposeTile(src + r * srcStride + c, srcStride, dst + c * dstStride + r, dstStride,
+				jmin(TRANSPOSE_TILE, rows - r), jmin(TRANSPOSE_TILE, cols - c));
+		}
+	}
+}
+
+void subtractCommonAverage(float* samples, int numSamples, int numChannels, const float* mask, int numIncluded)
+{
+	if (numIncluded == 0)
+		return;
+
+	const float norm = 1.0f / float(numIncluded);
+
+	for (int sample = 0; sample < numSamples; sample++)
+	{
+		float* x = samples + sample * numChannels;
+
+		int ch = 0;
+		float sum = 0.0f;
+
+#if NEUROPIX_AVX2
+		__m256 acc = _mm256_setzero_ps();
+
+		for (; ch + 8 <= numChannels; ch += 8)
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + ch), _mm256_loadu_ps(mask + ch)));
+
+		__m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+		acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+		acc4 = _mm_add_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+		sum = _mm_cvtss_f32(acc4);
+#elif NEUROPIX_SSE2
+		__m128 acc = _mm_setzero_ps();
+
+		for (; ch + 4 <= numChannels; ch += 4)
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + ch), _mm_loadu_ps(mask + ch)));
+
+		acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+		acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+		sum = _mm_cvtss_f32(acc);
+#endif
+
+		for (; ch < numChannels; ch++)
+			sum += x[ch] * mask[ch];
+
+		const float mean = sum * norm;
+
+		ch = 0;
+
+#if NEUROPIX_AVX2
+		__m256 mean8 = _mm256_set1_ps(mean);
+
+		for (; ch + 8 <= numChannels; ch += 8)
+			_mm256_storeu_ps(x + ch, _mm256_sub_ps(_mm256_loadu_ps(x + ch), _mm256_mul_ps(mean8, _mm256_loadu_ps(mask + ch))));
+#elif NEUROPIX_SSE2
+		__m128 mean4 = _mm_set1_ps(mean);
+
+		for (; ch + 4 <= numChannels; ch += 4)
+			_mm_storeu_ps(x + ch, _mm_sub_ps(_mm_loadu_ps(x + ch), _mm_mul_ps(mean4, _mm_loadu_ps(mask + ch))));
+#endif
+
+		for (; ch < numChannels; ch++)
+			x[ch] -= mean * mask[ch];
+	}
+}
+
+void subtractCommonMedian(float* samples, int numSamples, int numChannels, const int* channels, int numIncluded, float* scratch)
+{
+	if (numIncluded == 0)
+		return;
+
+	const int middle = numIncluded / 2;
+
+	for (int sample = 0; sample < numSamples; sample++)
+	{
+		float* x = samples + sample * numChannels;
+
+		for (int i = 0; i < numIncluded; i++)
+			scratch[i] = x[channels[i]];
+
+		std::nth_element(scratch, scratch + middle, scratch + numIncluded);
+
+		float median = scratch[middle];
+
+		// even count: average the two middle values; the lower one is the largest of the lower half
+		if ((numIncluded & 1) == 0)
+			median = 0.5f * (median + *std::max_element(scratch, scratch + middle));
+
+		for (int i = 0; i < numIncluded; i++)
+			x[channels[i]] -= median;
+	}
+}
+
+#define NEUROPIX_PI 3.14159265358979323846
+
+BiquadCoefficients BiquadCoefficients::highpass(double sampleRate, double frequency, double Q)
+{
+	const double w0 = 2.0 * NEUROPIX_PI * frequency / sampleRate;
+	const double alpha = std::sin(w0) / (2.0 * Q);
+	const double cosw0 = std::cos(w0);
+	const double a0 = 1.0 + alpha;
+
+	BiquadCoefficients c;
+	c.b0 = float((1.0 + cosw0) / 2.0 / a0);
+	c.b1 = float(-(1.0 + cosw0) / a0);
+	c.b2 = c.b0;
+	c.a1 = float(-2.0 * cosw0 / a0);
+	c.a2 = float((1.0 - alpha) / a0);
+	return c;
+}
+
+BiquadCoefficients BiquadCoefficients::lowpass(double sampleRate, double frequency, double Q)
+{
+	const double w0 = 2.0 * NEUROPIX_PI * frequency / sampleRate;
+	const double alpha = std::sin(w0) / (2.0 * Q);
+	const double cosw0 = std::cos(w0);
+	const double a0 = 1.0 + alpha;
+
+	BiquadCoefficients c;
+	c.b0 = float((1.0 - cosw0) / 2.0 / a0);
+	c.b1 = float((1.0 - cosw0) / a0);
+	c.b2 = c.b0;
+	c.a1 = float(-2.0 * cosw0 / a0);
+	c.a2 = float((1.0 - alpha) / a0);
+	return c;
+}
+
+MultiChannelBiquadCascade::MultiChannelBiquadCascade(int numChannels_) :
+	numChannels(numChannels_),
+	numSections(0)
+{
+	for (int i = 0; i < MAX_BIQUAD_SECTIONS; i++)
+	{
+		z1[i].setSize(numChannels);
+		z2[i].setSize(numChannels);
+	}
+}
+
+void MultiChannelBiquadCascade::clearSections()
+{
+	numSections = 0;
+}
+
+void MultiChannelBiquadCascade::addSection(const BiquadCoefficients& coefficients)
+{
+	if (numSections < MAX_BIQUAD_SECTIONS)
+		sections[numSections++] = coefficients;
+}
+
+void MultiChannelBiquadCascade::reset()
+{
+	for (int i = 0; i < MAX_BIQUAD_SECTIONS; i++)
+	{
+		z1[i].clear();
+		z2[i].clear();
+	}
+}
+
+void MultiChannelBiquadCascade::process(float* samples, int numSamples)
+{
+	for (int section = 0; section < numSections; section++)
+	{
+		const BiquadCoefficients& c = sections[section];
+		float* s1 = z1[section].getData();
+		float* s2 = z2[section].getData();
+
+		for (int sample = 0; sample < numSamples; sample++)
+		{
+			float* x = samples + sample * numChannels;
+
+			int ch = 0;
+
+#if NEUROPIX_AVX2
+			const __m256 b0 = _mm256_set1_ps(c.b0), b1 = _mm256_set1_ps(c.b1), b2 = _mm256_set1_ps(c.b2);
+			const __m256 a1 = _mm256_set1_ps(c.a1), a2 = _mm256_set1_ps(c.a2);
+
+			for (; ch + 8 <= numChannels; ch += 8)
+			{
+				__m256 in = _mm256_loadu_ps(x + ch);
+				__m256 state1 = _mm256_load_ps(s1 + ch);
+				__m256 state2 = _mm256_load_ps(s2 + ch);
+
+				__m256 out = _mm256_add_ps(_mm256_mul_ps(b0, in), state1);
+
+				_mm256_store_ps(s1 + ch, _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(b1, in), _mm256_mul_ps(a1, out)), state2));
+				_mm256_store_ps(s2 + ch, _mm256_sub_ps(_mm256_mul_ps(b2, in), _mm256_mul_ps(a2, out)));
+				_mm256_storeu_ps(x + ch, out);
+			}
+#elif NEUROPIX_SSE2
+			const __m128 b0 = _mm_set1_ps(c.b0), b1 = _mm_set1_ps(c.b1), b2 = _mm_set1_ps(c.b2);
+			const __m128 a1 = _mm_set1_ps(c.a1), a2 = _mm_set1_ps(c.a2);
+
+			for (; ch + 4 <= numChannels; ch += 4)
+			{
+				__m128 in = _mm_loadu_ps(x + ch);
+				__m128 state1 = _mm_load_ps(s1 + ch);
+				__m128 state2 = _mm_load_ps(s2 + ch);
+
+				__m128 out = _mm_add_ps(_mm_mul_ps(b0, in), state1);
+
+				_mm_store_ps(s1 + ch, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, in), _mm_mul_ps(a1, out)), state2));
+				_mm_store_ps(s2 + ch, _mm_sub_ps(_mm_mul_ps(b2, in), _mm_mul_ps(a2, out)));
+				_mm_storeu_ps(x + ch, out);
+			}
+#endif
+
+			for (; ch < numChannels; ch++)
+			{
+				float in = x[ch];
+				float out = c.b0 * in + s1[ch];
+
+				s1[ch] = c.b1 * in - c.a1 * out + s2[ch];
+				s2[ch] = c.b2 * in - c.a2 * out;
+				x[ch] = out;
+			}
+		}
+	}
+}
+
+void accumulateMoments(const float* samples, int numSamples, int numChannels, float* sums, float* sumSquares)
+{
+	for (int sample = 0; sample < numSamples; sample++)
+	{
+		const float* x = samples + sample * numChannels;
+
+		int ch = 0;
+
+#if NEUROPIX_AVX2
+		for (; ch + 8 <= numChannels; ch += 8)
+		{
+			__m256 in = _mm256_loadu_ps(x + ch);
+			_mm256_storeu_ps(sums + ch, _mm256_add_ps(_mm256_loadu_ps(sums + ch), in));
+			_mm256_storeu_ps(sumSquares + ch, _mm256_add_ps(_mm256_loadu_ps(sumSquares + ch), _mm256_mul_ps(in, in)));
+		}
+#elif NEUROPIX_SSE2
+		for (; ch + 4 <= numChannels; ch += 4)
+		{
+			__m128 in = _mm_loadu_ps(x + ch);
+			_mm_storeu_ps(sums + ch, _mm_add_ps(_mm_loadu_ps(sums + ch), in));
+			_mm_storeu_ps(sumSquares + ch, _mm_add_ps(_mm_loadu_ps(sumSquares + ch), _mm_mul_ps(in, in)));
+		}
+#endif
+
+		for (; ch < numChannels; ch++)
+		{
+			sums[ch] += x[ch];
+			sumSquares[ch] += x[ch] * x[ch];
+		}
+	}
+}
+
+SpikeDetector::SpikeDetector(int numChannels_) :
+	numChannels(numChannels_),
+	thresholdScale(5.0f),
+	refractorySamples(30),
+	warmupSamples(30000),
+	adaptationRate(0.0005f),
+	medianAbs(numChannels_),
+	previous(numChannels_),
+	lastSpike(numChannels_),
+	channelEnabled(numChannels_)
+{
+	for (int ch = 0; ch < numChannels; ch++)
+		channelEnabled[ch] = true;
+
+	reset();
+}
+
+void SpikeDetector::setChannelMask(const float* mask)
+{
+	for (int ch = 0; ch < numChannels; ch++)
+		channelEnabled[ch] = mask[ch] != 0.0f;
+}
+
+void SpikeDetector::reset(float initialNoise)
+{
+	for (int ch = 0; ch < numChannels; ch++)
+	{
+		medianAbs[ch] = initialNoise * 0.6745f;
+		previous[ch] = 0.0f;
+		lastSpike[ch] = -refractorySamples - 1;
+	}
+
+	sampleCount = 0;
+}
+
+int SpikeDetector::process(const float* samples, int numSamples, SpikeEvent* events, int maxEvents)
+{
+	int numEvents = 0;
+
+	const float thresholdFactor = thresholdScale / 0.6745f;
+	const float minStep = 1.0e-3f; // keeps a silent channel's estimate from stalling at zero
+
+	float* m = medianAbs.getData();
+	float* prev = previous.getData();
+
+	for (int sample = 0; sample < numSamples; sample++, sampleCount++)
+	{
+		const float* x = samples + sample * numChannels;
+
+		// the estimate is still converging from its initial value
+		const bool armed = sampleCount >= warmupSamples;
+
+		int ch = 0;
+
+#if NEUROPIX_AVX2
+		const __m256 signMask = _mm256_set1_ps(-0.0f);
+		const __m256 rate = _mm256_set1_ps(adaptationRate);
+		const __m256 min8 = _mm256_set1_ps(minStep);
+		const __m256 factor = _mm256_set1_ps(-thresholdFactor);
+
+		for (; ch + 8 <= numChannels; ch += 8)
+		{
+			__m256 in = _mm256_loadu_ps(x + ch);
+			__m256 med = _mm256_load_ps(m + ch);
+			__m256 last = _mm256_load_ps(prev + ch);
+
+			// crossing test against the threshold from before this sample
+			__m256 threshold = _mm256_mul_ps(med, factor);
+			__m256 crossed = _mm256_and_ps(_mm256_cmp_ps(in, threshold, _CMP_LT_OQ), _mm256_cmp_ps(last, threshold, _CMP_GE_OQ));
+
+			// move the median estimate one step towards |x|
+			__m256 step = _mm256_add_ps(_mm256_mul_ps(med, rate), min8);
+			__m256 above = _mm256_cmp_ps(_mm256_andnot_ps(signMask, in), med, _CMP_GT_OQ);
+			med = _mm256_add_ps(med, _mm256_blendv_ps(_mm256_xor_ps(step, signMask), step, above));
+
+			_mm256_store_ps(m + ch, med);
+			_mm256_store_ps(prev + ch, in);
+
+			int bits = armed ? _mm256_movemask_ps(crossed) : 0;
+
+			for (int b = 0; bits != 0; b++, bits >>= 1)
+			{
+				if ((bits & 1) && channelEnabled[ch + b] && sampleCount - lastSpike[ch + b] > refractorySamples && numEvents < maxEvents)
+				{
+					lastSpike[ch + b] = sampleCount;
+					events[numEvents].sampleIndex = sample;
+					events[numEvents].channel = ch + b;
+					numEvents++;
+				}
+			}
+		}
+#elif NEUROPIX_SSE2
+		const __m128 signMask = _mm_set1_ps(-0.0f);
+		const __m128 rate = _mm_set1_ps(adaptationRate);
+		const __m128 min4 = _mm_set1_ps(minStep);
+		const __m128 factor = _mm_set1_ps(-thresholdFactor);
+
+		for (; ch + 4 <= numChannels; ch += 4)
+		{
+			__m128 in = _mm_loadu_ps(x + ch);
+			__m128 med = _mm_load_ps(m + ch);
+			__m128 last = _mm_load_ps(prev + ch);
+
+			__m128 threshold = _mm_mul_ps(med, factor);
+			__m128 crossed = _mm_and_ps(_mm_cmplt_ps(in, threshold), _mm_cmpge_ps(last, threshold));
+
+			// step sign: +step where |x| > median, -step elsewhere (select without SSE4.1 blend)
+			__m128 step = _mm_add_ps(_mm_mul_ps(med, rate), min4);
+			__m128 above = _mm_cmpgt_ps(_mm_andnot_ps(signMask, in), med);
+			med = _mm_add_ps(med, _mm_xor_ps(step, _mm_andnot_ps(above, signMask)));
+
+			_mm_store_ps(m + ch, med);
+			_mm_store_ps(prev + ch, in);
+
+			int bits = armed ? _mm_movemask_ps(crossed) : 0;
+
+			for (int b = 0; bits != 0; b++, bits >>= 1)
+			{
+				if ((bits & 1) && channelEnabled[ch + b] && sampleCount - lastSpike[ch + b] > refractorySamples && numEvents < maxEvents)
+				{
+					lastSpike[ch + b] = sampleCount;
+					events[numEvents].sampleIndex = sample;
+					events[numEvents].channel = ch + b;
+					numEvents++;
+				}
+			}
+		}
+#endif
+
+		for (; ch < numChannels; ch++)
+		{
+			float threshold = -thresholdFactor * m[ch];
+
+			if (armed && channelEnabled[ch] && x[ch] < threshold && prev[ch] >= threshold
+				&& sampleCount - lastSpike[ch] > refractorySamples && numEvents < maxEvents)
+			{
+				lastSpike[ch] = sampleCount;
+				events[numEvents].sampleIndex = sample;
+				events[numEvents].channel = ch;
+				numEvents++;
+			}
+
+			float step = m[ch] * adaptationRate + minStep;
+			m[ch] += std::abs(x[ch]) > m[ch] ? step : -step;
+			prev[ch] = x[ch];
+		}
+	}
+
+	return numEvents;
+}
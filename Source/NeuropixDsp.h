@@ -0,0 +1,224 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2018 Allen Institute for Brain Science and Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __NEUROPIXDSP_H_3A1F7E52__
+#define __NEUROPIXDSP_H_3A1F7E52__
+
+#include <DataThreadHeaders.h>
+#include <stdint.h>
+
+/**
+
+	Sample-processing kernels used by the Probe acquisition threads.
+
+	Kernels are compiled for AVX2 when the plugin is built with
+	NEUROPIX_USE_AVX2, for SSE2 on any x86/x64 target, and fall back
+	to plain scalar loops elsewhere.
+
+*/
+
+#define NEUROPIX_SIMD_ALIGNMENT 32
+
+/** Fixed-size float vector whose storage is aligned for SIMD loads and stores. */
+class AlignedFloatBuffer
+{
+public:
+	AlignedFloatBuffer(int size = 0);
+
+	void setSize(int size);
+	void clear();
+
+	int size() const { return numElements; }
+
+	float* getData() { return data; }
+	const float* getData() const { return data; }
+
+	float& operator[](int i) { return data[i]; }
+	const float& operator[](int i) const { return data[i]; }
+
+private:
+	HeapBlock<char> storage;
+	float* data;
+	int numElements;
+
+	JUCE_DECLARE_NON_COPYABLE(AlignedFloatBuffer);
+};
+
+/** Returns a short description of the conversion kernel compiled into this build. */
+const char* getConversionKernelName();
+
+/** Converts a block of sample-major int16 data to float, multiplying each channel by its scale factor.
+
+	src and dst hold numSamples rows of numChannels values each; scale holds one factor per channel.
+*/
+void convertSamples(const int16_t* src, const float* scale, float* dst, int numSamples, int numChannels);
+
+/** Converts only the listed channels of a sample-major int16 block, writing them contiguously.
+
+	dst receives numSamples rows of numOutputChannels values; scale holds one factor per
+	output channel (already gathered). There is no 16-bit gather instruction, so the loads
+	are scalar; the loop still avoids touching the skipped channels' output entirely.
+*/
+void convertSamplesGather(const int16_t* src, int srcChannels, const int* channels, const float* scale,
+	float* dst, int numOutputChannels, int numSamples);
+
+/** Copies the listed channels of a sample-major float block into a contiguous block. */
+void gatherChannels(const float* src, int srcChannels, const int* channels, float* dst, int numOutputChannels, int numSamples);
+
+/** Transposes a rows x cols block of floats: dst[c * dstStride + r] = src[r * srcStride + c].
+
+	Works through the block in cache-sized tiles, using 8x8 (AVX2) or 4x4 (SSE2) register
+	transposes inside each tile. Used to move between the sample-major layout of the
+	electrode packets and the channel-major layout used by per-channel processing.
+*/
+void transposeSamples(const float* src, int srcStride, float* dst, int dstStride, int rows, int cols);
+
+/** Returns the channel-major row stride for up to maxSamples samples, padded to whole SIMD tiles. */
+inline int getChannelMajorStride(int maxSamples) { return (maxSamples + 7) & ~7; }
+
+/** Common average reference: for each sample, subtracts the mean of the included channels from them.
+
+	mask holds 1.0 for channels that form (and receive) the reference and 0.0 for excluded
+	channels, which are left untouched; numIncluded is the number of ones in mask.
+*/
+void subtractCommonAverage(float* samples, int numSamples, int numChannels, const float* mask, int numIncluded);
+
+/** Common median reference over the listed channels; scratch must hold numIncluded floats. */
+void subtractCommonMedian(float* samples, int numSamples, int numChannels, const int* channels, int numIncluded, float* scratch);
+
+/** Coefficients of one biquad section, normalised so that a0 = 1. */
+struct BiquadCoefficients
+{
+	float b0, b1, b2, a1, a2;
+
+	/** Second-order highpass / lowpass (RBJ cookbook); Q = 0.7071 gives a Butterworth response. */
+	static BiquadCoefficients highpass(double sampleRate, double frequency, double Q);
+	static BiquadCoefficients lowpass(double sampleRate, double frequency, double Q);
+};
+
+#define MAX_BIQUAD_SECTIONS 4
+
+/**
+	Cascade of biquad sections applied to every channel of a sample-major block.
+
+	Uses the transposed direct form II, with one pair of state variables per channel and
+	section. Each sample row is filtered across all channels at once, 8 (AVX2) or 4 (SSE2)
+	channels per instruction.
+*/
+class MultiChannelBiquadCascade
+{
+public:
+	MultiChannelBiquadCascade(int numChannels);
+
+	void clearSections();
+
+	/** Appends a section; ignored beyond MAX_BIQUAD_SECTIONS. */
+	void addSection(const BiquadCoefficients& coefficients);
+
+	int getNumSections() const { return numSections; }
+
+	/** Clears the filter state of all channels. */
+	void reset();
+
+	/** Filters numSamples rows of numChannels values in place. */
+	void process(float* samples, int numSamples);
+
+private:
+	int numChannels;
+	int numSections;
+
+	BiquadCoefficients sections[MAX_BIQUAD_SECTIONS];
+	AlignedFloatBuffer z1[MAX_BIQUAD_SECTIONS];
+	AlignedFloatBuffer z2[MAX_BIQUAD_SECTIONS];
+
+	JUCE_DECLARE_NON_COPYABLE(MultiChannelBiquadCascade);
+};
+
+/** Adds each channel's samples and squared samples to sums and sumSquares (sample-major input). */
+void accumulateMoments(const float* samples, int numSamples, int numChannels, float* sums, float* sumSquares);
+
+/** A negative threshold crossing on one channel; sampleIndex is relative to the processed block. */
+struct SpikeEvent
+{
+	int sampleIndex;
+	int channel;
+};
+
+/**
+	Per-channel adaptive-threshold spike detector for sample-major blocks.
+
+	The noise level of each channel is median(|x|) / 0.6745, with the median of |x| tracked
+	incrementally: every sample moves the estimate up or down by a small step proportional
+	to its current value. A spike is a downward crossing of -thresholdScale * noise, followed
+	by a refractory period during which the channel cannot fire again. The tracking and the
+	crossing test run across channels with SIMD; only crossings take the scalar path.
+
+	No events are reported for warmupSamples after a reset, while the estimate moves from
+	its initial value to the actual noise level, or on channels excluded by the channel mask.
+*/
+class SpikeDetector
+{
+public:
+	SpikeDetector(int numChannels);
+
+	/** Restarts noise tracking from initialNoise (microvolts) on all channels. */
+	void reset(float initialNoise = 10.0f);
+
+	/** Sets the threshold in multiples of the noise estimate. */
+	void setThresholdScale(float scale) { thresholdScale = scale; }
+	float getThresholdScale() const { return thresholdScale; }
+
+	/** Sets the refractory period in samples. */
+	void setRefractorySamples(int samples) { refractorySamples = samples; }
+
+	/** Sets how many samples after a reset are used only to train the noise estimate. */
+	void setWarmupSamples(int samples) { warmupSamples = samples; }
+
+	/** Reports events only on channels whose mask value is non-zero (e.g. the probe's CAR mask). */
+	void setChannelMask(const float* mask);
+
+	/** Returns the current noise estimate (microvolts) of a channel. */
+	float getNoiseLevel(int channel) const { return medianAbs[channel] / 0.6745f; }
+
+	/** Scans numSamples rows of numChannels values; returns the number of events written (at most maxEvents). */
+	int process(const float* samples, int numSamples, SpikeEvent* events, int maxEvents);
+
+private:
+	int numChannels;
+
+	float thresholdScale;
+	int refractorySamples;
+	int warmupSamples;
+	float adaptationRate;
+
+	AlignedFloatBuffer medianAbs;
+	AlignedFloatBuffer previous;
+	HeapBlock<int64> lastSpike;
+	HeapBlock<bool> channelEnabled;
+
+	int64 sampleCount;
+
+	JUCE_DECLARE_NON_COPYABLE(SpikeDetector);
+};
+
+#endif  // __NEUROPIXDSP_H_3A1F7E52__
@@ -66,8 +66,10 @@ void EditorBackground::paint(Graphics& g)
 
 }
 
-FifoMonitor::FifoMonitor(int id_, NeuropixThread* thread_) : id(id_), thread(thread_), fillPercentage(0.0)
+FifoMonitor::FifoMonitor(int id_, NeuropixThread* thread_) : id(id_), thread(thread_), fillPercentage(0.0), highWaterMark(0.0), hasLinkErrors(false)
 {
+	latestInterval.minimum = latestInterval.maximum = latestInterval.mean = 0.0f;
+
 	startTimer(500); // update fill percentage every 0.5 seconds
 }
 
@@ -77,6 +79,14 @@ void FifoMonitor::timerCallback()
 
 	if (slot != 255)
 	{
+		hasLinkErrors = thread->getLinkErrorCount(slot) > 0;
+		highWaterMark = thread->getFillHighWaterMark(slot);
+		latestInterval = thread->getLatestFillInterval(slot);
+
+		setTooltip("FIFO fill " + String(roundToInt(latestInterval.mean * 100.0f)) + "% mean, "
+			+ String(roundToInt(latestInterval.maximum * 100.0f)) + "% max over the last second, "
+			+ String(roundToInt(highWaterMark * 100.0f)) + "% peak\n"
+			+ thread->getLinkStatusString(slot));
 		setFillPercentage(thread->getFillPercentage(slot));
 	}
 }
@@ -96,17 +106,35 @@ void FifoMonitor::setFillPercentage(float fill_)
 
 void FifoMonitor::paint(Graphics& g)
 {
-	g.setColour(Colours::grey);
+	if (hasLinkErrors)
+		g.setColour(Colours::red);
+	else
+		g.setColour(Colours::grey);
 	g.fillRoundedRectangle(0, 0, this->getWidth(), this->getHeight(), 4);
 	g.setColour(Colours::lightslategrey);
 	g.fillRoundedRectangle(2, 2, this->getWidth()-4, this->getHeight()-4, 2);
 	
+	float height = this->getHeight() - 4;
+
+	// peak of the last interval behind the current fill
+	g.setColour(Colours::yellow.withAlpha(0.4f));
+	float maxHeight = height * latestInterval.maximum;
+	g.fillRoundedRectangle(2, this->getHeight()-2-maxHeight, this->getWidth() - 4, maxHeight, 2);
+
 	g.setColour(Colours::yellow);
-	float barHeight = (this->getHeight() - 4) * fillPercentage;
+	float barHeight = height * fillPercentage;
 	g.fillRoundedRectangle(2, this->getHeight()-2-barHeight, this->getWidth() - 4, barHeight, 2);
+
+	// high-water mark since acquisition started
+	if (highWaterMark > 0.0f)
+	{
+		g.setColour(Colours::orange);
+		float y = this->getHeight() - 2 - height * highWaterMark;
+		g.drawLine(2, y, this->getWidth() - 2, y, 1.5f);
+	}
 }
 
-ProbeButton::ProbeButton(int id_, NeuropixThread* thread_) : id(id_), thread(thread_), selected(false)
+ProbeButton::ProbeButton(int id_, NeuropixThread* thread_) : id(id_), thread(thread_), selected(false), configuring(false)
 {
 	status = ProbeStatus::DISCONNECTED;
 
@@ -180,6 +208,13 @@ void ProbeButton::paintButton(Graphics& g, bool isMouseOver, bool isButtonDown)
 	}
 		
 	g.fillEllipse(2, 2, 11, 11);
+
+	// settings are being written in the background
+	if (configuring)
+	{
+		g.setColour(Colours::yellow);
+		g.drawEllipse(2, 2, 11, 11, 2.0f);
+	}
 }
 
 void ProbeButton::setProbeStatus(ProbeStatus status)
@@ -195,6 +230,15 @@ ProbeStatus ProbeButton::getProbeStatus()
 	return status;
 }
 
+void ProbeButton::setConfiguring(bool configuring_)
+{
+	if (configuring != configuring_)
+	{
+		configuring = configuring_;
+		repaint();
+	}
+}
+
 void ProbeButton::timerCallback()
 {
 
@@ -249,6 +293,7 @@ NeuropixEditor::NeuropixEditor(GenericProcessor* parentNode, NeuropixThread* t,
 
     thread = t;
     canvas = nullptr;
+    signalChainUpdatePending = false;
 
     tabText = "Neuropix PXI";
 
@@ -331,6 +376,8 @@ NeuropixEditor::NeuropixEditor(GenericProcessor* parentNode, NeuropixThread* t,
 	background->toBack();
 	background->repaint();
 
+	thread->addConfigurationListener(this);
+
 	uiLoader = new BackgroundLoader(t, this);
 	uiLoader->startThread();
 	
@@ -338,7 +385,35 @@ NeuropixEditor::NeuropixEditor(GenericProcessor* parentNode, NeuropixThread* t,
 
 NeuropixEditor::~NeuropixEditor()
 {
+	thread->removeConfigurationListener(this);
+}
+
+void NeuropixEditor::probeConfigured(unsigned char slot, signed char port, const ProbeConfig& config, bool success)
+{
+	updateConfigurationStatus(slot, port);
+
+	if (!success)
+		CoreServices::sendStatusMessage("Failed to write settings for probe on slot " + String(slot) + ", port " + String(port));
 
+	// compact output follows the electrode selection; raw samples carry the gain in their bitVolts
+	if ((config.hasChannels && thread->isCompactOutput()) || (config.hasGains && thread->isRawDataMode()))
+		signalChainUpdatePending = true;
+
+	// restoring saved settings configures every probe in turn; rebuild the chain once at the end
+	if (signalChainUpdatePending && thread->isConfigurationIdle())
+	{
+		signalChainUpdatePending = false;
+		CoreServices::updateSignalChain(this);
+	}
+}
+
+void NeuropixEditor::updateConfigurationStatus(unsigned char slot, signed char port)
+{
+	for (auto button : probeButtons)
+	{
+		if (button->slot == slot && button->port == port)
+			button->setConfiguring(thread->isConfigurationPending(slot, port));
+	}
 }
 
 void NeuropixEditor::collapsedStateChanged()
@@ -444,8 +519,27 @@ void NeuropixEditor::saveEditorParameters(XmlElement* xml)
 		if (directory_name.length() == 2)
 			directory_name += "\\\\";
 		xmlNode->setAttribute("Slot" + String(slot) + "Directory", directory_name);
+		xmlNode->setAttribute("Slot" + String(slot) + "ReaderMode", int(thread->getReaderMode(slot)));
 	}
 
+	xmlNode->setAttribute("RawDataMode", thread->isRawDataMode());
+	xmlNode->setAttribute("HardwareClock", thread->usesHardwareClock());
+	xmlNode->setAttribute("Pipelined", thread->isPipelined());
+	xmlNode->setAttribute("CompactOutput", thread->isCompactOutput());
+	xmlNode->setAttribute("SoftwareGainCorrection", thread->usesSoftwareGainCorrection());
+
+	const AdaptiveWait& readWait = thread->getReadWaitParameters();
+	xmlNode->setAttribute("ReadSpinCount", readWait.spinCount);
+	xmlNode->setAttribute("ReadYieldCount", readWait.yieldCount);
+	xmlNode->setAttribute("ReadSleepPackets", readWait.sleepPackets);
+
+	const ThreadSchedulingOptions& scheduling = thread->getSchedulingOptions();
+	xmlNode->setAttribute("ThreadPriority", scheduling.priority);
+	xmlNode->setAttribute("RealtimeScheduling", scheduling.realtime);
+	xmlNode->setAttribute("AffinityMask", String::toHexString(int(scheduling.affinityMask)));
+	xmlNode->setAttribute("SpreadAcrossCores", scheduling.spreadAcrossCores);
+	xmlNode->setAttribute("IsolateMainThread", scheduling.isolateMainThread);
+
 }
 
 void NeuropixEditor::loadEditorParameters(XmlElement* xml)
@@ -463,7 +557,27 @@ void NeuropixEditor::loadEditorParameters(XmlElement* xml)
 				thread->setDirectoryForSlot(slot, directory);
 				directoryButtons[slot]->setLabel(directory.getFullPathName().substring(0, 2));
 				savingDirectories.set(slot, directory);
+				thread->setReaderMode(slot, ReaderMode(xmlNode->getIntAttribute("Slot" + String(slot) + "ReaderMode", THREAD_PER_PROBE)));
 			}
+
+			thread->setRawDataMode(xmlNode->getBoolAttribute("RawDataMode", false));
+			thread->setHardwareClock(xmlNode->getBoolAttribute("HardwareClock", false));
+			thread->setPipelined(xmlNode->getBoolAttribute("Pipelined", false));
+			thread->setCompactOutput(xmlNode->getBoolAttribute("CompactOutput", false));
+			thread->setSoftwareGainCorrection(xmlNode->getBoolAttribute("SoftwareGainCorrection", false));
+
+			const AdaptiveWait& readWait = thread->getReadWaitParameters();
+			thread->setReadWaitParameters(xmlNode->getIntAttribute("ReadSpinCount", readWait.spinCount),
+				xmlNode->getIntAttribute("ReadYieldCount", readWait.yieldCount),
+				xmlNode->getIntAttribute("ReadSleepPackets", readWait.sleepPackets));
+
+			ThreadSchedulingOptions scheduling = thread->getSchedulingOptions();
+			scheduling.priority = jlimit(0, 10, xmlNode->getIntAttribute("ThreadPriority", scheduling.priority));
+			scheduling.realtime = xmlNode->getBoolAttribute("RealtimeScheduling", scheduling.realtime);
+			scheduling.affinityMask = uint32(xmlNode->getStringAttribute("AffinityMask", "0").getHexValue32());
+			scheduling.spreadAcrossCores = xmlNode->getBoolAttribute("SpreadAcrossCores", scheduling.spreadAcrossCores);
+			scheduling.isolateMainThread = xmlNode->getBoolAttribute("IsolateMainThread", scheduling.isolateMainThread);
+			thread->setSchedulingOptions(scheduling);
 		}
 	}
 }
@@ -635,6 +749,8 @@ NeuropixInterface::NeuropixInterface(XmlElement info_, int slot_, int port_, Neu
 
     visualizationMode = 0;
 
+    activitySnapshot = new ChannelActivitySnapshot();
+
     addMouseListener(this, true);
 
     zoomHeight = 50;
@@ -684,8 +800,29 @@ NeuropixInterface::NeuropixInterface(XmlElement info_, int slot_, int port_, Neu
     filterComboBox->addListener(this);
     filterComboBox->addItem("ON", 1);
     filterComboBox->addItem("OFF", 2);
+    filterComboBox->addItem("SW 300-6k", 3);
+    filterComboBox->setTooltip("ON/OFF: hardware 300 Hz highpass. SW 300-6k: hardware highpass off, 300-6000 Hz software bandpass");
     filterComboBox->setSelectedId(1, dontSendNotification);
 
+	carComboBox = new ComboBox("CarComboBox");
+	carComboBox->setBounds(400, 350, 75, 22);
+	carComboBox->addListener(this);
+	carComboBox->addItem("OFF", CAR_NONE + 1);
+	carComboBox->addItem("MEAN", CAR_MEAN + 1);
+	carComboBox->addItem("MEDIAN", CAR_MEDIAN + 1);
+	carComboBox->setSelectedId(CAR_NONE + 1, dontSendNotification);
+	carComboBox->setTooltip("Subtract the common average or median of the connected channels from the AP band");
+
+	spikeComboBox = new ComboBox("SpikeComboBox");
+	spikeComboBox->setBounds(400, 540, 75, 22);
+	spikeComboBox->addListener(this);
+	spikeComboBox->addItem("OFF", 1);
+	spikeComboBox->addItem("4x noise", 2);
+	spikeComboBox->addItem("5x noise", 3);
+	spikeComboBox->addItem("6x noise", 4);
+	spikeComboBox->setSelectedId(1, dontSendNotification);
+	spikeComboBox->setTooltip("Detect negative threshold crossings on the AP band, at a multiple of each channel's noise level");
+
 	bistComboBox = new ComboBox("BistComboBox");
 	bistComboBox->setBounds(550, 500, 225, 22);
 	bistComboBox->addListener(this);
@@ -749,6 +886,18 @@ NeuropixInterface::NeuropixInterface(XmlElement info_, int slot_, int port_, Neu
     referenceViewButton->addListener(this);
     referenceViewButton->setTooltip("View reference of each channel");
 
+    spikeViewButton = new UtilityButton("VIEW", Font("Small Text", 12, Font::plain));
+    spikeViewButton->setRadius(3.0f);
+    spikeViewButton->setBounds(480,542,45,18);
+    spikeViewButton->addListener(this);
+    spikeViewButton->setTooltip("View spike rate of each channel (AP RMS when spike detection is off)");
+
+    lfpViewButton = new UtilityButton("LFP", Font("Small Text", 12, Font::plain));
+    lfpViewButton->setRadius(3.0f);
+    lfpViewButton->setBounds(530,542,45,18);
+    lfpViewButton->addListener(this);
+    lfpViewButton->setTooltip("View LFP power of each channel");
+
     annotationButton = new UtilityButton("ADD", Font("Small Text", 12, Font::plain));
     annotationButton->setRadius(3.0f);
     annotationButton->setBounds(400,480,40,18);
@@ -765,6 +914,8 @@ NeuropixInterface::NeuropixInterface(XmlElement info_, int slot_, int port_, Neu
     addAndMakeVisible(apGainComboBox);
     addAndMakeVisible(referenceComboBox);
     addAndMakeVisible(filterComboBox);
+	addAndMakeVisible(carComboBox);
+	addAndMakeVisible(spikeComboBox);
 	addAndMakeVisible(bistComboBox);
 
     addAndMakeVisible(enableButton);
@@ -772,6 +923,8 @@ NeuropixInterface::NeuropixInterface(XmlElement info_, int slot_, int port_, Neu
     addAndMakeVisible(lfpGainViewButton);
     addAndMakeVisible(apGainViewButton);
     addAndMakeVisible(referenceViewButton);
+    addAndMakeVisible(spikeViewButton);
+    addAndMakeVisible(lfpViewButton);
 	addAndMakeVisible(annotationButton);
 	addAndMakeVisible(bistButton);
 
@@ -816,6 +969,18 @@ NeuropixInterface::NeuropixInterface(XmlElement info_, int slot_, int port_, Neu
     filterLabel->setColour(Label::textColourId, Colours::grey);
     addAndMakeVisible(filterLabel);
 
+	carLabel = new Label("CAR", "COMMON REFERENCE");
+	carLabel->setFont(Font("Small Text", 13, Font::plain));
+	carLabel->setBounds(396,330,200,20);
+	carLabel->setColour(Label::textColourId, Colours::grey);
+	addAndMakeVisible(carLabel);
+
+	spikeLabel = new Label("SPIKES", "SPIKE DETECTION");
+	spikeLabel->setFont(Font("Small Text", 13, Font::plain));
+	spikeLabel->setBounds(396,520,200,20);
+	spikeLabel->setColour(Label::textColourId, Colours::grey);
+	addAndMakeVisible(spikeLabel);
+
     outputLabel = new Label("OUTPUT", "OUTPUT");
     outputLabel->setFont(Font("Small Text", 13, Font::plain));
     outputLabel->setBounds(396,330,200,20);
@@ -990,7 +1155,9 @@ void NeuropixInterface::comboBoxChanged(ComboBox* comboBox)
 
 			//std::cout << " Received gain combo box signal" << 
 
-			thread->setAllGains(slot, port, gainSettingAp, gainSettingLfp);
+			ProbeConfig config;
+			config.setGains(gainSettingAp, gainSettingLfp);
+			thread->queueConfiguration(slot, port, config);
 
 			for (int i = 0; i < 960; i++)
 			{
@@ -1002,8 +1169,14 @@ void NeuropixInterface::comboBoxChanged(ComboBox* comboBox)
         {
 
 			int refSetting = comboBox->getSelectedId() - 1;
-            
-			thread->setAllReferences(slot, port, refSetting);
+
+			np::channelreference_t reference;
+			unsigned char intRefElectrodeBank;
+			thread->getReference(refSetting, reference, intRefElectrodeBank);
+
+			ProbeConfig config;
+			config.setReferences(reference, intRefElectrodeBank);
+			thread->queueConfiguration(slot, port, config);
 
 			for (int i = 0; i < 960; i++)
 			{
@@ -1018,9 +1191,30 @@ void NeuropixInterface::comboBoxChanged(ComboBox* comboBox)
 
             // 0 = ON, disableHighPass = false -> (300 Hz highpass cut-off filter enabled)
             // 1 = OFF, disableHighPass = true -> (300 Hz highpass cut-off filter disabled)
-			bool disableHighPass = (filterSetting == 1);
-			thread->setFilter(slot, port, disableHighPass);
+            // 2 = SW, disableHighPass = true -> (300-6000 Hz software bandpass instead)
+			bool disableHighPass = (filterSetting >= 1);
+
+			ProbeConfig config;
+			config.setApFilterState(disableHighPass);
+			thread->queueConfiguration(slot, port, config);
+
+			thread->setSoftwareFilter(slot, port, filterSetting == 2);
         }
+		else if (comboBox == carComboBox)
+		{
+			thread->setCommonReference(slot, port, CommonReferenceMode(comboBox->getSelectedId() - 1));
+		}
+		else if (comboBox == spikeComboBox)
+		{
+			// 1 = OFF, 2..4 = 4x..6x noise
+			int spikeSetting = comboBox->getSelectedId() - 1;
+			thread->setSpikeDetection(slot, port, spikeSetting > 0, float(spikeSetting + 3));
+
+			// the TTL outputs up to the spike line are added or removed
+			CoreServices::updateSignalChain(editor);
+		}
+
+        editor->updateConfigurationStatus(slot, port);
         
         repaint();
     } 
@@ -1049,26 +1243,26 @@ void NeuropixInterface::buttonClicked(Button* button)
 
     } else if (button == enableViewButton)
     {
-        visualizationMode = 0;
-        stopTimer();
-        repaint();
+        setVisualizationMode(0);
     } 
      else if (button == apGainViewButton)
     {
-        visualizationMode = 1;
-        stopTimer();
-        repaint();
+        setVisualizationMode(1);
     } else if (button == lfpGainViewButton)
     {
-        visualizationMode = 2;
-        stopTimer();
-        repaint();
+        setVisualizationMode(2);
     }
     else if (button == referenceViewButton)
     {
-        visualizationMode = 3;
-        stopTimer();
-        repaint();
+        setVisualizationMode(3);
+    }
+    else if (button == spikeViewButton)
+    {
+        setVisualizationMode(4);
+    }
+    else if (button == lfpViewButton)
+    {
+        setVisualizationMode(5);
     } else if (button == enableButton)
     {
         if (!editor->acquisitionIsActive)
@@ -1114,7 +1308,12 @@ void NeuropixInterface::buttonClicked(Button* button)
                 }
             }
 
-            thread->selectElectrodes(slot, port, channelStatus);
+            ProbeConfig config;
+            config.setChannels(channelStatus);
+            thread->queueConfiguration(slot, port, config);
+
+            editor->updateConfigurationStatus(slot, port);
+
             repaint();
         }
 
@@ -1981,29 +2180,56 @@ Colour NeuropixInterface::getChannelColour(int i)
     }
 }
 
-void NeuropixInterface::timerCallback()
+void NeuropixInterface::setVisualizationMode(int mode)
 {
-    Random random;
-    uint64 timestamp;
-    uint64 eventCode;
+    visualizationMode = mode;
 
-    int numSamples;
+    bool showsActivity = (mode == 4 || mode == 5);
 
-    if (editor->acquisitionIsActive)
-        numSamples = 10;
+    thread->setActivityMonitoring(slot, port, showsActivity);
+
+    if (showsActivity)
+        startTimer(100); // 10 Hz, snapshots are published at 20 Hz
     else
-        numSamples = 0;
-    
-    //
+        stopTimer();
+
+    repaint();
+}
 
-    if (numSamples > 0)
+void NeuropixInterface::timerCallback()
+{
+    bool haveSnapshot = editor->acquisitionIsActive
+        && thread->getActivitySnapshot(slot, port, *activitySnapshot);
+
+    if (haveSnapshot)
     {
+        bool showSpikeRate = thread->isSpikeDetectionEnabled(slot, port);
+
         for (int i = 0; i < 960; i++)
         {
+            if (channelStatus[i] != 1)
+            {
+                channelColours.set(i, Colour(20, 20, 20));
+                continue;
+            }
+
+            int ch = getChannelForElectrode(i);
+
             if (visualizationMode == 4)
-                channelColours.set(i, Colour(random.nextInt(256), random.nextInt(256), 0));
+            {
+                // spike rate: full brightness at 50 Hz; AP RMS: full brightness at 50 uV
+                float level = showSpikeRate ? activitySnapshot->spikeRate[ch] / 50.0f
+                                            : activitySnapshot->apRms[ch] / 50.0f;
+                uint8 c = uint8(20 + 235 * jlimit(0.0f, 1.0f, level));
+                channelColours.set(i, Colour(c, c, 0));
+            }
             else
-                channelColours.set(i, Colour(0, random.nextInt(256), random.nextInt(256)));
+            {
+                // LFP power on a log scale from 1 to 10^5 uV^2
+                float level = std::log10(1.0f + activitySnapshot->lfpPower[ch]) / 5.0f;
+                uint8 c = uint8(20 + 235 * jlimit(0.0f, 1.0f, level));
+                channelColours.set(i, Colour(0, c, c));
+            }
         }
     }
     else {
@@ -2013,18 +2239,9 @@ void NeuropixInterface::timerCallback()
         }
     }
 
-    // NOT WORKING:
-    //{
-    //  ScopedLock(*thread->getMutex());
-    //  int numSamples2 = inputBuffer->readAllFromBuffer(displayBuffer, &timestamp, &eventCode, 10000);
-    //}
-    //
-
     repaint();
 }
 
-
-
 int NeuropixInterface::getChannelForElectrode(int ch)
 {
     // returns actual mapped channel for individual electrode
@@ -2108,6 +2325,12 @@ void NeuropixInterface::saveParameters(XmlElement* xml)
 	xmlNode->setAttribute("filterCut", filterComboBox->getText());
 	xmlNode->setAttribute("filterCutIndex", filterComboBox->getSelectedId());
 
+	xmlNode->setAttribute("commonReference", carComboBox->getText());
+	xmlNode->setAttribute("commonReferenceIndex", carComboBox->getSelectedId());
+
+	xmlNode->setAttribute("spikeDetection", spikeComboBox->getText());
+	xmlNode->setAttribute("spikeDetectionIndex", spikeComboBox->getSelectedId());
+
 	xmlNode->setAttribute("visualizationMode", visualizationMode);
 
 	// annotations
@@ -2200,6 +2423,21 @@ void NeuropixInterface::loadParameters(XmlElement* xml)
 					thread->p_settings.disableHighPass = false;
 				else
 					thread->p_settings.disableHighPass = true;
+				thread->p_settings.softwareFilter = (filterSetting == 2);
+
+				int commonReferenceIndex = xmlNode->getIntAttribute("commonReferenceIndex", CAR_NONE + 1);
+				if (commonReferenceIndex != carComboBox->getSelectedId())
+				{
+					carComboBox->setSelectedId(commonReferenceIndex, dontSendNotification);
+				}
+				thread->p_settings.commonReference = CommonReferenceMode(commonReferenceIndex - 1);
+
+				int spikeDetectionIndex = xmlNode->getIntAttribute("spikeDetectionIndex", 1);
+				if (spikeDetectionIndex != spikeComboBox->getSelectedId())
+				{
+					spikeComboBox->setSelectedId(spikeDetectionIndex, dontSendNotification);
+				}
+				thread->p_settings.spikeThreshold = spikeDetectionIndex > 1 ? float(spikeDetectionIndex + 2) : 0.0f;
 				
 
 				forEachXmlChildElement(*xmlNode, annotationNode)
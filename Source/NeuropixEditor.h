@@ -68,6 +68,9 @@ public:
 	ProbeStatus getProbeStatus();
 	void timerCallback();
 
+	/** Shows whether settings for this probe are still being written. */
+	void setConfiguring(bool configuring);
+
 	unsigned char slot;
 	signed char port;
 	bool connected;
@@ -79,9 +82,10 @@ private:
 	int id;
 	ProbeStatus status;
 	bool selected;
+	bool configuring;
 };
 
-class FifoMonitor : public Component, public Timer
+class FifoMonitor : public Component, public SettableTooltipClient, public Timer
 {
 public:
 	FifoMonitor(int id, NeuropixThread* thread);
@@ -97,6 +101,9 @@ private:
 	void paint(Graphics& g);
 
 	float fillPercentage;
+	float highWaterMark;
+	FifoFillSample latestInterval;
+	bool hasLinkErrors;
 	NeuropixThread* thread;
 	int id;
 };
@@ -112,7 +119,7 @@ private:
 	NeuropixEditor* ed;
 };
 
-class NeuropixEditor : public VisualizerEditor, public ComboBox::Listener
+class NeuropixEditor : public VisualizerEditor, public ComboBox::Listener, public ProbeConfigurationListener
 {
 public:
 	NeuropixEditor(GenericProcessor* parentNode, NeuropixThread* thread, bool useDefaultParameterEditors);
@@ -126,6 +133,12 @@ public:
 	void saveEditorParameters(XmlElement*);
 	void loadEditorParameters(XmlElement*);
 
+	/** Updates the probe button and, where the outputs changed, the signal chain once the worker has drained its queue. */
+	void probeConfigured(unsigned char slot, signed char port, const ProbeConfig& config, bool success) override;
+
+	/** Refreshes the configuring indicator of a probe's button. */
+	void updateConfigurationStatus(unsigned char slot, signed char port);
+
 	Visualizer* createNewCanvas(void);
 
 	OwnedArray<ProbeButton> probeButtons;
@@ -148,6 +161,8 @@ private:
 	NeuropixCanvas* canvas;
 	NeuropixThread* thread;
 
+	bool signalChainUpdatePending;
+
 	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(NeuropixEditor);
 
 };
@@ -233,6 +248,8 @@ private:
 	ScopedPointer<ComboBox> apGainComboBox;
 	ScopedPointer<ComboBox> referenceComboBox;
 	ScopedPointer<ComboBox> filterComboBox;
+	ScopedPointer<ComboBox> carComboBox;
+	ScopedPointer<ComboBox> spikeComboBox;
 
 	ScopedPointer<ComboBox> bistComboBox;
 
@@ -245,6 +262,8 @@ private:
 	ScopedPointer<Label> apGainLabel;
 	ScopedPointer<Label> referenceLabel;
 	ScopedPointer<Label> filterLabel;
+	ScopedPointer<Label> carLabel;
+	ScopedPointer<Label> spikeLabel;
 	ScopedPointer<Label> outputLabel;
 	ScopedPointer<Label> bistLabel;
 	ScopedPointer<Label> annotationLabelLabel;
@@ -256,6 +275,13 @@ private:
 	ScopedPointer<UtilityButton> lfpGainViewButton;
 	ScopedPointer<UtilityButton> apGainViewButton;
 	ScopedPointer<UtilityButton> referenceViewButton;
+	ScopedPointer<UtilityButton> spikeViewButton;
+	ScopedPointer<UtilityButton> lfpViewButton;
+
+	ScopedPointer<ChannelActivitySnapshot> activitySnapshot;
+
+	/** Switches the visualization mode, starting activity monitoring for the SPIKES and LFP modes. */
+	void setVisualizationMode(int mode);
 	ScopedPointer<UtilityButton> outputOnButton;
 	ScopedPointer<UtilityButton> outputOffButton;
 	ScopedPointer<UtilityButton> annotationButton;
@@ -41,7 +41,13 @@ NeuropixThread::NeuropixThread(SourceNode* sn) :
 	recordingNumber(0),
 	isRecording(false),
 	recordingTimer(this),
-	recordToNpx(false)
+	recordToNpx(false),
+	rawDataMode(false),
+	useHardwareClock(false),
+	schedulingApplied(false),
+	pipelined(false),
+	compactOutput(false),
+	softwareGainCorrection(false)
 {
 	progressBar = new ProgressBar(initializationProgress);
 
@@ -71,18 +77,30 @@ NeuropixThread::NeuropixThread(SourceNode* sn) :
 
 	np::scanPXI(&availableslotmask);
 
+	inventory = new InventoryCache();
+
 	for (int slot = 0; slot < 32; slot++)
 	{
 		if ((availableslotmask >> slot) & 1)
 		{
-			basestations.add(new Basestation(slot));
+			basestations.add(new Basestation(slot, inventory));
 		}
 	}
 
+	std::cout << "Hardware inventory: " << inventory->hits << " cached, " << inventory->misses << " read from hardware" << std::endl;
+
+	inventory->save();
+
+	configurationWorker = new ProbeConfigurationWorker(this);
+	configurationWorker->startThread();
+
 }
 
 NeuropixThread::~NeuropixThread()
 {
+	fifoTelemetryMonitor = nullptr;
+	configurationWorker = nullptr;
+
     closeConnection();
 }
 
@@ -95,11 +113,50 @@ void NeuropixThread::applyProbeSettingsQueue()
 {
 	for (auto settings : probeSettingsUpdateQueue)
 	{
-		selectElectrodes(settings.slot, settings.port, settings.channelStatus);
-		setAllGains(settings.slot, settings.port, settings.apGainIndex, settings.lfpGainIndex);
-		setAllReferences(settings.slot, settings.port, settings.refChannelIndex);
-		setFilter(settings.slot, settings.port, settings.disableHighPass);
+		// collect the hardware settings so each probe is written once
+		ProbeConfig config;
+
+		np::channelreference_t reference;
+		unsigned char intRefElectrodeBank;
+		getReference(settings.refChannelIndex, reference, intRefElectrodeBank);
+
+		config.setChannels(settings.channelStatus);
+		config.setGains(settings.apGainIndex, settings.lfpGainIndex);
+		config.setReferences(reference, intRefElectrodeBank);
+		config.setApFilterState(settings.disableHighPass);
+
+		configurationWorker->queue(settings.slot, settings.port, config);
+
+		setSoftwareFilter(settings.slot, settings.port, settings.softwareFilter);
+		setSpikeDetection(settings.slot, settings.port, settings.spikeThreshold > 0.0f, settings.spikeThreshold);
+		setCommonReference(settings.slot, settings.port, settings.commonReference);
 	}
+
+	// the caller rebuilds the signal chain next, which needs the restored channel maps
+	configurationWorker->waitUntilIdle(-1);
+}
+
+BasestationInitializer::BasestationInitializer(Basestation* basestation_, bool syncMaster_, ProbeInitializationListener* listener_) :
+	ThreadPoolJob("init_slot_" + String(basestation_->slot)),
+	basestation(basestation_),
+	syncMaster(syncMaster_),
+	listener(listener_)
+{
+}
+
+ThreadPoolJob::JobStatus BasestationInitializer::runJob()
+{
+	np::NP_ErrorCode ec = basestation->init();
+
+	if (ec != np::SUCCESS)
+		std::cout << "Slot " << int(basestation->slot) << ": probe initialization failed with error code " << ec << std::endl;
+
+	if (syncMaster)
+		basestation->setSyncAsInput();
+
+	basestation->initializeProbes(listener);
+
+	return jobHasFinished;
 }
 
 void NeuropixThread::openConnection()
@@ -107,11 +164,13 @@ void NeuropixThread::openConnection()
 
 	bool foundSync = false;
 
+	std::cout << "Using " << getConversionKernelName() << " sample conversion kernel." << std::endl;
+
+	int syncIndex = -1;
+
 	for (int i = 0; i < basestations.size(); i++)
 	{
 
-		basestations[i]->init();
-
 		if (basestations[i]->getProbeCount() > 0)
 		{
 			totalProbes += basestations[i]->getProbeCount();
@@ -120,7 +179,7 @@ void NeuropixThread::openConnection()
 
 			if (!foundSync)
 			{
-				basestations[i]->setSyncAsInput();
+				syncIndex = i;
 				selectedSlot = basestations[i]->slot;
 				selectedPort = basestations[i]->probes[0]->port;
 				foundSync = true;
@@ -137,20 +196,61 @@ void NeuropixThread::openConnection()
 
 				basestations[i]->probes[probe_num]->lfpBuffer = sourceBuffers.getLast();
 
-				CoreServices::sendStatusMessage("Initializing probe " + String(probe_num + 1) + "/" + String(basestations[i]->getProbeCount()) + 
-					" on Basestation " + String(i + 1) + "/" + String(basestations.size()));
-				
-				basestations[i]->initializeProbes();
+				basestations[i]->probes[probe_num]->setRawDataMode(rawDataMode);
+				basestations[i]->probes[probe_num]->setHardwareClock(useHardwareClock);
+				basestations[i]->probes[probe_num]->readWait = readWait;
+				basestations[i]->probes[probe_num]->scheduling = scheduling;
+				basestations[i]->probes[probe_num]->setPipelined(pipelined);
+				basestations[i]->probes[probe_num]->setCompactOutput(compactOutput);
+				basestations[i]->probes[probe_num]->setSoftwareGainCorrection(softwareGainCorrection);
+				basestations[i]->probes[probe_num]->threadIndex = probes.size();
+				probes.add(basestations[i]->probes[probe_num]);
 			}
 				
 		}
 			
 	}
 
+	initializationProgress = 0;
+	numProbesInitialized = 0;
+
+	CoreServices::sendStatusMessage("Initializing " + String(totalProbes) + " probes on " + String(basestations.size()) + " basestations...");
+
+	// Slots initialize concurrently. The API makes no promise about concurrent calls
+	// into one slot, so the ports of each basestation still come up in turn.
+	{
+		OwnedArray<BasestationInitializer> jobs;
+		ThreadPool pool(jmax(1, basestations.size()));
+
+		for (int i = 0; i < basestations.size(); i++)
+		{
+			if (basestations[i]->getProbeCount() > 0)
+			{
+				jobs.add(new BasestationInitializer(basestations[i], i == syncIndex, this));
+				pool.addJob(jobs.getLast(), false);
+			}
+		}
+
+		for (auto job : jobs)
+			pool.waitForJobToFinish(job, -1);
+	}
+
 	np::setParameter(np::NP_PARAM_BUFFERSIZE, MAXSTREAMBUFFERSIZE);
 	np::setParameter(np::NP_PARAM_BUFFERCOUNT, MAXSTREAMBUFFERCOUNT);
 }
 
+void NeuropixThread::probeInitialized(Probe* probe, bool success)
+{
+	int count = ++numProbesInitialized;
+
+	initializationProgress = double(count) / double(jmax(1, totalProbes));
+
+	std::cout << "Slot " << int(probe->basestation->slot) << ", port " << int(probe->port)
+		<< (success ? " initialized" : " failed to initialize") << std::endl;
+
+	CoreServices::sendStatusMessage("Initialized probe " + String(count) + "/" + String(totalProbes));
+}
+
 int NeuropixThread::getNumBasestations()
 {
 	return basestations.size();
@@ -343,6 +443,12 @@ String NeuropixThread::getInfoString()
 /** Initializes data transfer.*/
 bool NeuropixThread::startAcquisition()
 {
+	// settings still being written would race with arming; give them a moment, but keep the GUI responsive
+	if (!configurationWorker->waitUntilIdle(START_CONFIGURATION_WAIT_MS))
+	{
+		CoreServices::sendStatusMessage("Probe settings are still being written, please start acquisition again");
+		return false;
+	}
 
     // clear the internal buffer (happens in initializeProbe)
 	//for (int i = 0; i < sourceBuffers.size(); i++)
@@ -359,21 +465,71 @@ bool NeuropixThread::startAcquisition()
 
 	last_npx_timestamp = 0;
 
-	startTimer(500 * totalProbes); // wait for signal chain to be built
+	schedulingApplied = false;
+
+	acquisitionRequestTicks = Time::getHighResolutionTicks();
+
+	startTimer(START_POLL_INTERVAL_MS); // wait for signal chain to be built
 	
     return true;
 }
 
+bool NeuropixThread::isReadyToStart()
+{
+	if (!CoreServices::getAcquisitionStatus())
+		return false;
+
+	for (int i = 0; i < basestations.size(); i++)
+	{
+		if (basestations[i]->getProbeCount() > 0 && !basestations[i]->isArmed())
+			return false;
+	}
+
+	return true;
+}
+
 void NeuropixThread::timerCallback()
 {
+	double waitMs = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - acquisitionRequestTicks) * 1000.0;
+
+	// fall back to the old fixed delay if readiness is never reported
+	double timeoutMs = jmax(START_TIMEOUT_MIN_MS, 500 * totalProbes);
+
+	bool ready = isReadyToStart();
+
+	if (!ready && waitMs < timeoutMs)
+		return;
+
+	stopTimer();
+
+	if (ready)
+		std::cout << "Ready to start after " << waitMs << " ms" << std::endl;
+	else
+		std::cout << "Timed out waiting for signal chain and basestations after " << waitMs << " ms; starting anyway" << std::endl;
+
+	int64 phaseStartTicks = Time::getHighResolutionTicks();
+
 	for (int i = 0; i < basestations.size(); i++)
 	{
 		basestations[i]->startAcquisition();
 	}
 
+	std::cout << "Started " << basestations.size() << " basestations in "
+		<< Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - phaseStartTicks) * 1000.0 << " ms" << std::endl;
+
+	phaseStartTicks = Time::getHighResolutionTicks();
+
+	if (fifoTelemetryMonitor == nullptr)
+		fifoTelemetryMonitor = new FifoTelemetryMonitor(probes);
+
+	fifoTelemetryMonitor->startThread();
+
 	startThread();
 
-    stopTimer();
+	std::cout << "Started acquisition threads in "
+		<< Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - phaseStartTicks) * 1000.0 << " ms ("
+		<< Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - acquisitionRequestTicks) * 1000.0
+		<< " ms after request)" << std::endl;
 
 	progressBar->setVisible(false);
 
@@ -435,6 +591,9 @@ bool NeuropixThread::stopAcquisition()
         signalThreadShouldExit();
     }
 
+	if (fifoTelemetryMonitor != nullptr)
+		fifoTelemetryMonitor->stopThread(1000);
+
 	for (int i = 0; i < basestations.size(); i++)
 	{
 		basestations[i]->stopAcquisition();
@@ -536,20 +695,29 @@ void NeuropixThread::setDefaultChannelNames()
 
 		for (int probe_num = 0; probe_num < totalProbes; probe_num++)
 		{
-			for (int i = 0; i < 384; i++)
+			Probe* probe = probes[probe_num];
+
+			int numOutputChannels = probe != nullptr ? probe->getNumOutputChannels() : 384;
+
+			// in compact output mode the names map each output back to its probe channel
+			for (int i = 0; i < numOutputChannels; i++)
 			{
+				int channel = probe != nullptr ? probe->getOutputChannel(i) : i;
+
 				ChannelCustomInfo info;
-				info.name = "AP" + String(i + 1);
-				info.gain = 0.1950000f;
+				info.name = "AP" + String(channel + 1);
+				info.gain = (rawDataMode && probe != nullptr) ? probe->apScale[channel] : 0.1950000f;
 				channelInfo.set(chan, info);
 				chan++;
 			}
 
-			for (int i = 0; i < 384; i++)
+			for (int i = 0; i < numOutputChannels; i++)
 			{
+				int channel = probe != nullptr ? probe->getOutputChannel(i) : i;
+
 				ChannelCustomInfo info;
-				info.name = "LFP" + String(i + 1);
-				info.gain = 0.1950000f;
+				info.name = "LFP" + String(channel + 1);
+				info.gain = (rawDataMode && probe != nullptr) ? probe->lfpScale[channel] : 0.1950000f;
 				channelInfo.set(chan, info);
 				chan++;
 			}
@@ -577,10 +745,12 @@ int NeuropixThread::getNumDataOutputs(DataChannel::DataChannelTypes type, int su
 
 	int numChans;
 
-	if (type == DataChannel::DataChannelTypes::HEADSTAGE_CHANNEL && subProcessorIdx % 2 == 0)
-		numChans = 384;
-	else if (type == DataChannel::DataChannelTypes::HEADSTAGE_CHANNEL && subProcessorIdx % 2 == 1)
-		numChans = 384;
+	if (type == DataChannel::DataChannelTypes::HEADSTAGE_CHANNEL)
+	{
+		Probe* probe = getProbeForSubProcessor(subProcessorIdx);
+
+		numChans = probe != nullptr ? probe->getNumOutputChannels() : 384;
+	}
 	else
 		numChans = 0;
 
@@ -594,6 +764,13 @@ int NeuropixThread::getNumTTLOutputs(int subProcessorIdx) const
 {
 	if (subProcessorIdx % 2 == 0)
 	{
+		Probe* probe = getProbeForSubProcessor(subProcessorIdx);
+
+		// the spike line sits above the status bits passed through in the event code,
+		// so every bit up to it has to be declared for it to be reported
+		if (probe != nullptr && probe->spikeDetectionEnabled)
+			return SPIKE_TTL_BIT + 1;
+
 		return 1;
 	}
 	else {
@@ -622,9 +799,199 @@ float NeuropixThread::getSampleRate(int subProcessorIdx) const
 float NeuropixThread::getBitVolts(const DataChannel* chan) const
 {
 	//std::cout << "BIT VOLTS == 0.195" << std::endl;
+
+	if (rawDataMode)
+	{
+		// gains are set for all channels of a probe at once and software gain correction is off in raw mode,
+		// so the first channel's scale applies to the whole band
+		int subProcessorIdx = chan->getSubProcessorIdx();
+		Probe* probe = getProbeForSubProcessor(subProcessorIdx);
+
+		if (probe != nullptr)
+			return subProcessorIdx % 2 == 0 ? probe->apScale[0] : probe->lfpScale[0];
+	}
+
 	return 0.1950000f;
 }
 
+Probe* NeuropixThread::getProbeForSubProcessor(int subProcessorIdx) const
+{
+	return probes[subProcessorIdx / 2];
+}
+
+Probe* NeuropixThread::getProbe(unsigned char slot, signed char port) const
+{
+	for (auto probe : probes)
+	{
+		if (probe->basestation->slot == slot && probe->port == port)
+			return probe;
+	}
+
+	return nullptr;
+}
+
+void NeuropixThread::queueConfiguration(unsigned char slot, signed char port, const ProbeConfig& config)
+{
+	configurationWorker->queue(slot, port, config);
+}
+
+bool NeuropixThread::isConfigurationPending(unsigned char slot, signed char port)
+{
+	return configurationWorker->isPending(slot, port);
+}
+
+bool NeuropixThread::isConfigurationIdle()
+{
+	return configurationWorker->isIdle();
+}
+
+void NeuropixThread::addConfigurationListener(ProbeConfigurationListener* listener)
+{
+	configurationListeners.addIfNotAlreadyThere(listener);
+}
+
+void NeuropixThread::removeConfigurationListener(ProbeConfigurationListener* listener)
+{
+	configurationListeners.removeFirstMatchingValue(listener);
+}
+
+void NeuropixThread::probeConfigured(unsigned char slot, signed char port, const ProbeConfig& config, bool success)
+{
+	for (auto listener : configurationListeners)
+		listener->probeConfigured(slot, port, config, success);
+}
+
+ProbeConfigurationWorker::ProbeConfigurationWorker(NeuropixThread* thread_) :
+	Thread("probe_configuration"),
+	thread(thread_),
+	busy(false),
+	busySlot(0),
+	busyPort(0),
+	idle(true)
+{
+	idle.signal();
+}
+
+ProbeConfigurationWorker::~ProbeConfigurationWorker()
+{
+	signalThreadShouldExit();
+	workAvailable.signal();
+	stopThread(5000);
+}
+
+void ProbeConfigurationWorker::queue(unsigned char slot, signed char port, const ProbeConfig& config)
+{
+	const ScopedLock sl(lock);
+
+	idle.reset();
+
+	for (int i = 0; i < pending.size(); i++)
+	{
+		if (pending[i].slot == slot && pending[i].port == port)
+		{
+			pending.getReference(i).config.merge(config);
+			return;
+		}
+	}
+
+	PendingConfiguration request;
+	request.slot = slot;
+	request.port = port;
+	request.config = config;
+	pending.add(request);
+
+	workAvailable.signal();
+}
+
+bool ProbeConfigurationWorker::isPending(unsigned char slot, signed char port)
+{
+	const ScopedLock sl(lock);
+
+	if (busy && busySlot == slot && busyPort == port)
+		return true;
+
+	for (int i = 0; i < pending.size(); i++)
+	{
+		if (pending[i].slot == slot && pending[i].port == port)
+			return true;
+	}
+
+	return false;
+}
+
+bool ProbeConfigurationWorker::waitUntilIdle(int timeoutMs)
+{
+	return idle.wait(timeoutMs);
+}
+
+bool ProbeConfigurationWorker::isIdle()
+{
+	const ScopedLock sl(lock);
+
+	return !busy && pending.size() == 0;
+}
+
+void ProbeConfigurationWorker::run()
+{
+	while (!threadShouldExit())
+	{
+		PendingConfiguration request;
+
+		{
+			const ScopedLock sl(lock);
+
+			if (pending.size() == 0)
+			{
+				busy = false;
+				idle.signal();
+			}
+			else
+			{
+				request = pending[0];
+				pending.remove(0);
+
+				busy = true;
+				busySlot = request.slot;
+				busyPort = request.port;
+			}
+		}
+
+		if (!busy)
+		{
+			workAvailable.wait(100);
+			continue;
+		}
+
+		bool success = false;
+
+		if (Probe* probe = thread->getProbe(request.slot, request.port))
+		{
+			success = probe->applyConfiguration(request.config) == np::SUCCESS;
+		}
+
+		{
+			const ScopedLock sl(lock);
+			busy = false;
+		}
+
+		(new ProbeConfiguredMessage(thread, request.slot, request.port, request.config, success))->post();
+	}
+}
+
+ProbeConfiguredMessage::ProbeConfiguredMessage(NeuropixThread* thread_, unsigned char slot_, signed char port_, const ProbeConfig& config_, bool success_) :
+	thread(thread_),
+	slot(slot_),
+	port(port_),
+	config(config_),
+	success(success_)
+{
+}
+
+void ProbeConfiguredMessage::messageCallback()
+{
+	thread->probeConfigured(slot, port, config, success);
+}
+
 
 void NeuropixThread::selectElectrodes(unsigned char slot, signed char port, Array<int> channelStatus)
 {
@@ -639,10 +1006,19 @@ void NeuropixThread::selectElectrodes(unsigned char slot, signed char port, Arra
 void NeuropixThread::setAllReferences(unsigned char slot, signed char port, int refId)
 {
  
-	np::NP_ErrorCode ec;
 	np::channelreference_t reference;
 	unsigned char intRefElectrodeBank;
 
+	getReference(refId, reference, intRefElectrodeBank);
+
+	for (int i = 0; i < basestations.size(); i++)
+	{
+		basestations[i]->setReferences(slot, port, reference, intRefElectrodeBank);
+	}
+}
+
+void NeuropixThread::getReference(int refId, np::channelreference_t& reference, unsigned char& intRefElectrodeBank)
+{
 	if (refId == 0) // external reference
 	{
 		reference = np::EXT_REF;
@@ -658,11 +1034,6 @@ void NeuropixThread::setAllReferences(unsigned char slot, signed char port, int
 		reference = np::INT_REF;
 		intRefElectrodeBank = refId - 2;
 	}
-
-	for (int i = 0; i < basestations.size(); i++)
-	{
-		basestations[i]->setReferences(slot, port, reference, intRefElectrodeBank);
-	}
 }
 
 void NeuropixThread::setAllGains(unsigned char slot, signed char port, unsigned char apGain, unsigned char lfpGain)
@@ -679,6 +1050,66 @@ void NeuropixThread::setFilter(unsigned char slot, signed char port, bool disabl
 		basestations[i]->setApFilterState(slot, port, disableHighPass);
 }
 
+void NeuropixThread::setSpikeDetection(unsigned char slot, signed char port, bool enabled, float thresholdScale)
+{
+	for (int i = 0; i < basestations.size(); i++)
+		basestations[i]->setSpikeDetection(slot, port, enabled, thresholdScale);
+}
+
+int NeuropixThread::readSpikeEvents(unsigned char slot, signed char port, ProbeSpikeEvent* dest, int maxEvents)
+{
+	for (auto probe : probes)
+	{
+		if (probe->basestation->slot == slot && probe->port == port)
+			return probe->spikeQueue.read(dest, maxEvents);
+	}
+
+	return 0;
+}
+
+void NeuropixThread::setActivityMonitoring(unsigned char slot, signed char port, bool enabled)
+{
+	for (auto probe : probes)
+	{
+		if (probe->basestation->slot == slot && probe->port == port)
+			probe->setActivityMonitoring(enabled);
+	}
+}
+
+bool NeuropixThread::getActivitySnapshot(unsigned char slot, signed char port, ChannelActivitySnapshot& snapshot)
+{
+	for (auto probe : probes)
+	{
+		if (probe->basestation->slot == slot && probe->port == port)
+			return probe->activity.getSnapshot(snapshot);
+	}
+
+	return false;
+}
+
+bool NeuropixThread::isSpikeDetectionEnabled(unsigned char slot, signed char port)
+{
+	for (auto probe : probes)
+	{
+		if (probe->basestation->slot == slot && probe->port == port)
+			return probe->spikeDetectionEnabled;
+	}
+
+	return false;
+}
+
+void NeuropixThread::setSoftwareFilter(unsigned char slot, signed char port, bool enabled)
+{
+	for (int i = 0; i < basestations.size(); i++)
+		basestations[i]->setSoftwareFilter(slot, port, enabled);
+}
+
+void NeuropixThread::setCommonReference(unsigned char slot, signed char port, CommonReferenceMode mode)
+{
+	for (int i = 0; i < basestations.size(); i++)
+		basestations[i]->setCommonReference(slot, port, mode);
+}
+
 void NeuropixThread::setTriggerMode(bool trigger)
 {
     //ConfigAccessErrorCode caec = neuropix.neuropix_triggerMode(trigger);
@@ -696,6 +1127,136 @@ void NeuropixThread::setAutoRestart(bool restart)
 	autoRestart = restart;
 }
 
+void NeuropixThread::setRawDataMode(bool raw)
+{
+	rawDataMode = raw;
+
+	for (auto probe : probes)
+		probe->setRawDataMode(raw);
+
+	std::cout << "Raw data mode " << (raw ? "enabled" : "disabled") << std::endl;
+}
+
+bool NeuropixThread::isRawDataMode() const
+{
+	return rawDataMode;
+}
+
+void NeuropixThread::setHardwareClock(bool useHardwareClock_)
+{
+	useHardwareClock = useHardwareClock_;
+
+	for (auto probe : probes)
+		probe->setHardwareClock(useHardwareClock);
+
+	std::cout << "Hardware sample clock " << (useHardwareClock ? "enabled" : "disabled") << std::endl;
+}
+
+bool NeuropixThread::usesHardwareClock() const
+{
+	return useHardwareClock;
+}
+
+void NeuropixThread::setPipelined(bool pipelined_)
+{
+	pipelined = pipelined_;
+
+	for (auto probe : probes)
+		probe->setPipelined(pipelined);
+}
+
+bool NeuropixThread::isPipelined() const
+{
+	return pipelined;
+}
+
+void NeuropixThread::setCompactOutput(bool compact)
+{
+	compactOutput = compact;
+
+	for (auto probe : probes)
+		probe->setCompactOutput(compactOutput);
+
+	std::cout << "Compact output " << (compactOutput ? "enabled" : "disabled") << std::endl;
+}
+
+bool NeuropixThread::isCompactOutput() const
+{
+	return compactOutput;
+}
+
+void NeuropixThread::setSoftwareGainCorrection(bool enabled)
+{
+	softwareGainCorrection = enabled;
+
+	for (auto probe : probes)
+		probe->setSoftwareGainCorrection(softwareGainCorrection);
+
+	std::cout << "Software gain correction " << (softwareGainCorrection ? "enabled" : "disabled") << std::endl;
+}
+
+bool NeuropixThread::usesSoftwareGainCorrection() const
+{
+	return softwareGainCorrection;
+}
+
+void NeuropixThread::addChannelDataListener(ChannelDataListener* listener)
+{
+	for (auto probe : probes)
+		probe->addChannelDataListener(listener);
+}
+
+void NeuropixThread::removeChannelDataListener(ChannelDataListener* listener)
+{
+	for (auto probe : probes)
+		probe->removeChannelDataListener(listener);
+}
+
+void NeuropixThread::setReadWaitParameters(int spinCount, int yieldCount, int sleepPackets)
+{
+	readWait.spinCount = spinCount;
+	readWait.yieldCount = yieldCount;
+	readWait.sleepPackets = sleepPackets;
+
+	for (auto probe : probes)
+		probe->readWait = readWait;
+}
+
+const AdaptiveWait& NeuropixThread::getReadWaitParameters() const
+{
+	return readWait;
+}
+
+void NeuropixThread::setSchedulingOptions(const ThreadSchedulingOptions& options)
+{
+	scheduling = options;
+
+	for (auto probe : probes)
+		probe->scheduling = scheduling;
+}
+
+const ThreadSchedulingOptions& NeuropixThread::getSchedulingOptions() const
+{
+	return scheduling;
+}
+
+void NeuropixThread::setReaderMode(int slotIndex, ReaderMode mode)
+{
+	if (slotIndex < basestations.size())
+	{
+		std::cout << "Thread setting reader mode for slot " << slotIndex << " to " << int(mode) << std::endl;
+		basestations[slotIndex]->setReaderMode(mode);
+	}
+}
+
+ReaderMode NeuropixThread::getReaderMode(int slotIndex)
+{
+	if (slotIndex < basestations.size())
+		return basestations[slotIndex]->getReaderMode();
+	else
+		return THREAD_PER_PROBE;
+}
+
 void NeuropixThread::setDirectoryForSlot(int slotIndex, File directory)
 {
 
@@ -807,9 +1368,92 @@ float NeuropixThread::getFillPercentage(unsigned char slot)
 	return 0.0f;
 }
 
+float NeuropixThread::getFillHighWaterMark(unsigned char slot)
+{
+	for (int i = 0; i < basestations.size(); i++)
+	{
+		if (basestations[i]->slot == slot)
+			return basestations[i]->getFillHighWaterMark();
+	}
+
+	return 0.0f;
+}
+
+FifoFillSample NeuropixThread::getLatestFillInterval(unsigned char slot)
+{
+	for (int i = 0; i < basestations.size(); i++)
+	{
+		if (basestations[i]->slot == slot)
+			return basestations[i]->getLatestFillInterval();
+	}
+
+	FifoFillSample empty = { 0.0f, 0.0f, 0.0f };
+	return empty;
+}
+
+const PacketCounters* NeuropixThread::getPacketCounters(unsigned char slot, signed char port) const
+{
+	for (auto probe : probes)
+	{
+		if (probe->basestation->slot == slot && probe->port == port)
+			return &probe->counters;
+	}
+
+	return nullptr;
+}
+
+int64 NeuropixThread::getLinkErrorCount(unsigned char slot) const
+{
+	int64 errors = 0;
+
+	for (auto probe : probes)
+	{
+		if (probe->basestation->slot == slot)
+			errors += probe->counters.getTotalErrors();
+	}
+
+	return errors;
+}
+
+String NeuropixThread::getLinkStatusString(unsigned char slot) const
+{
+	String status;
+
+	for (auto probe : probes)
+	{
+		if (probe->basestation->slot == slot)
+		{
+			status += "Port " + String(probe->port) + "\n";
+			status += probe->counters.toString() + "\n\n";
+		}
+	}
+
+	return status.trim();
+}
+
 bool NeuropixThread::updateBuffer()
 {
 
+	if (!schedulingApplied)
+	{
+		scheduling.isolateCurrentThread();
+		schedulingApplied = true;
+	}
+
+	if (rawDataMode)
+	{
+		int samplesMoved = 0;
+
+		for (auto probe : probes)
+		{
+			samplesMoved += probe->apRawBuffer->publishTo(probe->apBuffer);
+			samplesMoved += probe->lfpRawBuffer->publishTo(probe->lfpBuffer);
+		}
+
+		if (samplesMoved == 0)
+			wait(1);
+	}
+
 	if (recordToNpx)
 	{
 
@@ -32,6 +32,10 @@
 #include "neuropix-api/NeuropixAPI.h"
 #include "NeuropixComponents.h"
 
+#define START_POLL_INTERVAL_MS 10 // readiness polling while acquisition starts
+#define START_TIMEOUT_MIN_MS 1000 // shortest wait before starting without readiness
+#define START_CONFIGURATION_WAIT_MS 1000 // longest wait for pending probe settings before refusing to start
+
 
 enum BISTS {
 	BIST_SIGNAL = 1,
@@ -62,6 +66,92 @@ public:
 };
 
 
+/** Initializes one basestation and its probes on a ThreadPool thread. */
+class BasestationInitializer : public ThreadPoolJob
+{
+public:
+	BasestationInitializer(Basestation* basestation, bool syncMaster, ProbeInitializationListener* listener);
+
+	JobStatus runJob() override;
+
+private:
+	Basestation* basestation;
+	bool syncMaster;
+	ProbeInitializationListener* listener;
+};
+
+/** Receives the outcome of configurations queued with NeuropixThread::queueConfiguration. */
+class ProbeConfigurationListener
+{
+public:
+	virtual ~ProbeConfigurationListener() {}
+
+	/** Called on the message thread once a queued configuration has been written to the probe. */
+	virtual void probeConfigured(unsigned char slot, signed char port, const ProbeConfig& config, bool success) = 0;
+};
+
+/** Applies probe configurations off the message thread.
+
+	Each probe has at most one waiting configuration: a request queued while an earlier one
+	is still waiting is merged into it, so rapid clicks result in a single write.
+*/
+class ProbeConfigurationWorker : public Thread
+{
+public:
+	ProbeConfigurationWorker(NeuropixThread* thread);
+	~ProbeConfigurationWorker();
+
+	/** Queues a configuration, merging it with any configuration still waiting for the same probe. */
+	void queue(unsigned char slot, signed char port, const ProbeConfig& config);
+
+	/** Returns true while a configuration for the probe is waiting or being applied. */
+	bool isPending(unsigned char slot, signed char port);
+
+	/** Blocks until every queued configuration has been applied; returns false on timeout. */
+	bool waitUntilIdle(int timeoutMs);
+
+	/** Returns true if no configuration is waiting or being applied. */
+	bool isIdle();
+
+	void run() override;
+
+private:
+	struct PendingConfiguration
+	{
+		unsigned char slot;
+		signed char port;
+		ProbeConfig config;
+	};
+
+	NeuropixThread* thread;
+
+	Array<PendingConfiguration> pending;
+	bool busy;
+	unsigned char busySlot;
+	signed char busyPort;
+
+	CriticalSection lock;
+	WaitableEvent workAvailable;
+	WaitableEvent idle;
+};
+
+/** Delivers a configuration result to the listeners on the message thread. */
+class ProbeConfiguredMessage : public CallbackMessage
+{
+public:
+	ProbeConfiguredMessage(NeuropixThread* thread, unsigned char slot, signed char port, const ProbeConfig& config, bool success);
+
+	void messageCallback() override;
+
+private:
+	NeuropixThread* thread;
+	unsigned char slot;
+	signed char port;
+	ProbeConfig config;
+	bool success;
+};
+
+
 /**
 
 	Communicates with imec Neuropixels probes.
@@ -72,7 +162,7 @@ public:
 
 
 
-class NeuropixThread : public DataThread, public Timer
+class NeuropixThread : public DataThread, public Timer, public ProbeInitializationListener
 {
 
 public:
@@ -93,8 +183,12 @@ public:
 	/** Returns version and serial number info for hardware and API as XML.*/
 	XmlElement getInfoXml();
 
+	/** Initializes all basestations in parallel, one ThreadPool job per slot. */
 	void openConnection();
 
+	/** Updates the initialization progress as each probe comes up. */
+	void probeInitialized(Probe* probe, bool success) override;
+
 	/** Initializes data transfer.*/
 	bool startAcquisition() override;
 
@@ -130,12 +224,38 @@ public:
 	/** Selects which reference is used for each channel. */
 	void setAllReferences(unsigned char slot, signed char port, int refId);
 
+	/** Converts a reference combo box index into an API reference and internal reference bank. */
+	void getReference(int refId, np::channelreference_t& reference, unsigned char& intRefElectrodeBank);
+
 	/** Sets the gain for each channel. */
 	void setAllGains(unsigned char slot, signed char port, unsigned char apGain, unsigned char lfpGain);
 
 	/** Sets the filter for all channels. */
 	void setFilter(unsigned char slot, signed char port, bool filterState);
 
+	/** Enables spike detection on a probe's AP band, with the threshold in multiples of the noise level.
+		Detected spikes raise event code bit SPIKE_TTL_BIT, so the AP subprocessor then declares SPIKE_TTL_BIT + 1
+		TTL outputs: the status bits below the spike line are reported along with it. */
+	void setSpikeDetection(unsigned char slot, signed char port, bool enabled, float thresholdScale);
+
+	/** Moves up to maxEvents detected spikes of a probe into dest; returns the number moved. */
+	int readSpikeEvents(unsigned char slot, signed char port, ProbeSpikeEvent* dest, int maxEvents);
+
+	/** Starts or stops the per-channel activity summaries of a probe. */
+	void setActivityMonitoring(unsigned char slot, signed char port, bool enabled);
+
+	/** Copies a probe's latest activity snapshot; returns false if none is available. */
+	bool getActivitySnapshot(unsigned char slot, signed char port, ChannelActivitySnapshot& snapshot);
+
+	/** Returns true if spike detection is enabled on a probe. */
+	bool isSpikeDetectionEnabled(unsigned char slot, signed char port);
+
+	/** Enables the software 300 - 6000 Hz bandpass on a probe's AP band. */
+	void setSoftwareFilter(unsigned char slot, signed char port, bool enabled);
+
+	/** Sets the common reference subtracted from a probe's AP band. */
+	void setCommonReference(unsigned char slot, signed char port, CommonReferenceMode mode);
+
 	/** Toggles between internal and external triggering. */
 	void setTriggerMode(bool trigger);
 
@@ -151,9 +271,86 @@ public:
 	/** Toggles between auto-restart setting. */
 	void setAutoRestart(bool restart);
 
-	/** Starts data acquisition after a certain time.*/
+	/** Passes samples through as unscaled ADC values; the microvolt scale is published via the channel bitVolts.
+		Common referencing, software filtering, spike detection and activity tracking do not run in this mode. */
+	void setRawDataMode(bool raw);
+
+	/** Returns true if samples are passed through unscaled. */
+	bool isRawDataMode() const;
+
+	/** Derives sample numbers from the hardware timestamps, so dropped packets do not shift later samples. */
+	void setHardwareClock(bool useHardwareClock);
+
+	/** Returns true if sample numbers follow the hardware timestamps. */
+	bool usesHardwareClock() const;
+
+	/** Reads the hardware on one thread per probe and converts samples on another, connected by a packet ring. */
+	void setPipelined(bool pipelined);
+
+	/** Returns true if reading and conversion run on separate threads. */
+	bool isPipelined() const;
+
+	/** Outputs only connected, non-reference channels; the channel names carry the probe channel numbers.
+		Changing this or the electrode selection requires a signal chain update. */
+	void setCompactOutput(bool compact);
+
+	/** Returns true if disconnected and reference channels are left out of the output. */
+	bool isCompactOutput() const;
+
+	/** Applies electrode, gain, reference and filter changes on the configuration worker thread. */
+	void queueConfiguration(unsigned char slot, signed char port, const ProbeConfig& config);
+
+	/** Returns true while a queued configuration for the probe has not been applied yet. */
+	bool isConfigurationPending(unsigned char slot, signed char port);
+
+	/** Returns true once every queued configuration has been applied. */
+	bool isConfigurationIdle();
+
+	/** Registers a listener for the results of queued configurations; called on the message thread. */
+	void addConfigurationListener(ProbeConfigurationListener* listener);
+	void removeConfigurationListener(ProbeConfigurationListener* listener);
+
+	/** Passes a configuration result to the listeners; called on the message thread. */
+	void probeConfigured(unsigned char slot, signed char port, const ProbeConfig& config, bool success);
+
+	/** Returns the probe on a slot and port, or nullptr. */
+	Probe* getProbe(unsigned char slot, signed char port) const;
+
+	/** Applies the per-electrode gain calibration in the microvolt scale factors instead of the basestation. */
+	void setSoftwareGainCorrection(bool enabled);
+
+	/** Returns true if gain calibration is applied in software. */
+	bool usesSoftwareGainCorrection() const;
+
+	/** Registers a listener for the channel-major AP data of every probe; call while acquisition is stopped. */
+	void addChannelDataListener(ChannelDataListener* listener);
+	void removeChannelDataListener(ChannelDataListener* listener);
+
+	/** Tunes how probe threads wait when the hardware FIFO is empty (see AdaptiveWait). */
+	void setReadWaitParameters(int spinCount, int yieldCount, int sleepPackets);
+
+	/** Returns the current wait parameters for the probe threads. */
+	const AdaptiveWait& getReadWaitParameters() const;
+
+	/** Sets the priority, realtime scheduling and core affinity used by the acquisition threads. */
+	void setSchedulingOptions(const ThreadSchedulingOptions& options);
+
+	/** Returns the current scheduling options for the acquisition threads. */
+	const ThreadSchedulingOptions& getSchedulingOptions() const;
+
+	/** Selects whether a basestation's probes are read by one thread each or by a single polling thread. */
+	void setReaderMode(int slotIndex, ReaderMode mode);
+
+	/** Returns the reader mode of a basestation. */
+	ReaderMode getReaderMode(int slotIndex);
+
+	/** Starts data acquisition once the signal chain is running and every basestation is armed,
+		or after a timeout.*/
 	void timerCallback();
 
+	/** Returns true when the signal chain reports acquisition and every populated basestation is armed. */
+	bool isReadyToStart();
+
 	/** Starts recording.*/
 	void startRecording();
 
@@ -189,8 +386,24 @@ public:
 
 	float getFillPercentage(unsigned char slot);
 
+	/** Returns the highest FIFO fill reached on a basestation since acquisition started. */
+	float getFillHighWaterMark(unsigned char slot);
+
+	/** Returns the FIFO fill min/max/mean over the most recent telemetry interval for a basestation. */
+	FifoFillSample getLatestFillInterval(unsigned char slot);
+
+	/** Returns the packet and link-error counters for a probe, or nullptr if it does not exist. */
+	const PacketCounters* getPacketCounters(unsigned char slot, signed char port) const;
+
+	/** Returns the total number of link errors for all probes on a basestation. */
+	int64 getLinkErrorCount(unsigned char slot) const;
+
+	/** Returns a per-port summary of the packet counters for a basestation. */
+	String getLinkStatusString(unsigned char slot) const;
+
 	ScopedPointer<ProgressBar> progressBar;
 	double initializationProgress;
+	Atomic<int> numProbesInitialized;
 
 	/* Helper for loading probes in the background */
 	struct probeSettings {
@@ -201,10 +414,14 @@ public:
 		int lfpGainIndex;
 		int refChannelIndex;
 		bool disableHighPass;
+		bool softwareFilter;
+		float spikeThreshold; // 0 = detection off
+		CommonReferenceMode commonReference;
 	} p_settings;
 	Array<probeSettings> probeSettingsUpdateQueue;
 
 	void updateProbeSettingsQueue();
+	/** Queues the saved settings on the configuration worker and waits for them to be written. */
 	void applyProbeSettingsQueue();
 
 	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(NeuropixThread);
@@ -217,6 +434,15 @@ private:
 	bool autoRestart;
 
 	bool isRecording;
+	bool rawDataMode;
+	bool useHardwareClock;
+	AdaptiveWait readWait;
+	ThreadSchedulingOptions scheduling;
+	bool schedulingApplied;
+	int64 acquisitionRequestTicks;
+	bool pipelined;
+	bool compactOutput;
+	bool softwareGainCorrection;
 
 	long int counter;
 	int recordingNumber;
@@ -242,6 +468,17 @@ private:
 
 	OwnedArray<Basestation> basestations;
 
+	/** All probes, in subprocessor order (AP and LFP subprocessor per probe). */
+	Array<Probe*> probes;
+
+	ScopedPointer<FifoTelemetryMonitor> fifoTelemetryMonitor;
+	ScopedPointer<InventoryCache> inventory;
+
+	ScopedPointer<ProbeConfigurationWorker> configurationWorker;
+	Array<ProbeConfigurationListener*> configurationListeners;
+
+	Probe* getProbeForSubProcessor(int subProcessorIdx) const;
+
 	np::NP_ErrorCode errorCode;
 	NeuropixAPI api;
 